@@ -305,6 +305,7 @@ static command_result runLuaScript(color_ostream &out, std::string name, vector<
     data.pcmd = &name;
     data.pargs = &args;
 
+    Lua::ProfileScope scope("script", name);
     bool ok = Lua::RunCoreQueryLoop(out, Lua::Core::State, init_run_script, &data);
 
     return ok ? CR_OK : CR_FAILURE;
@@ -28,6 +28,8 @@ distribution.
 #include <vector>
 #include <map>
 
+#include <sys/stat.h>
+
 #include "MemAccess.h"
 #include "Core.h"
 #include "Error.h"
@@ -2110,6 +2112,17 @@ static int internal_patchBytes(lua_State *L)
     return 1;
 }
 
+static int internal_getFileMTime(lua_State *L)
+{
+    const char *path = luaL_checkstring(L, 1);
+    struct stat info;
+    if (stat(path, &info) != 0)
+        return 0;
+    lua_pushnumber(L, info.st_mtime);
+    lua_pushnumber(L, info.st_size);
+    return 2;
+}
+
 static int internal_memmove(lua_State *L)
 {
     void *dest = checkaddr(L, 1);
@@ -2195,6 +2208,38 @@ static int internal_diffscan(lua_State *L)
     return 1;
 }
 
+static int internal_setObjectCache(lua_State *L)
+{
+    LuaWrapper::SetObjectCacheEnabled(L, lua_toboolean(L, 1));
+    return 0;
+}
+
+static int internal_setFastFieldReads(lua_State *L)
+{
+    LuaWrapper::SetFastFieldReads(lua_toboolean(L, 1));
+    return 0;
+}
+
+static int internal_getObjectCacheStats(lua_State *L)
+{
+    auto cache = LuaWrapper::GetObjectCacheStats(L);
+    if (!cache)
+        return 0;
+
+    lua_newtable(L);
+    lua_pushboolean(L, cache->enabled);
+    lua_setfield(L, -2, "enabled");
+    lua_pushnumber(L, cache->pushes);
+    lua_setfield(L, -2, "pushes");
+    lua_pushnumber(L, cache->hits);
+    lua_setfield(L, -2, "hits");
+    lua_pushnumber(L, cache->pushes - cache->hits);
+    lua_setfield(L, -2, "allocs");
+    lua_pushinteger(L, lua_gc(L, LUA_GCCOUNT, 0));
+    lua_setfield(L, -2, "heap_kb");
+    return 1;
+}
+
 static const luaL_Reg dfhack_internal_funcs[] = {
     { "getAddress", internal_getAddress },
     { "setAddress", internal_setAddress },
@@ -2203,10 +2248,14 @@ static const luaL_Reg dfhack_internal_funcs[] = {
     { "getMemRanges", internal_getMemRanges },
     { "patchMemory", internal_patchMemory },
     { "patchBytes", internal_patchBytes },
+    { "getFileMTime", internal_getFileMTime },
     { "memmove", internal_memmove },
     { "memcmp", internal_memcmp },
     { "memscan", internal_memscan },
     { "diffscan", internal_diffscan },
+    { "setObjectCache", internal_setObjectCache },
+    { "getObjectCacheStats", internal_getObjectCacheStats },
+    { "setFastFieldReads", internal_setFastFieldReads },
     { NULL, NULL }
 };
 
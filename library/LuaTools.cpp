@@ -27,6 +27,10 @@ distribution.
 #include <string>
 #include <vector>
 #include <map>
+#include <algorithm>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "MemAccess.h"
 #include "Core.h"
@@ -42,6 +46,7 @@ distribution.
 #include "modules/Job.h"
 #include "modules/Translation.h"
 #include "modules/Units.h"
+#include "modules/EventManager.h"
 
 #include "LuaWrapper.h"
 #include "LuaTools.h"
@@ -49,11 +54,13 @@ distribution.
 #include "MiscUtils.h"
 
 #include "df/job.h"
+#include "df/construction.h"
 #include "df/job_item.h"
 #include "df/building.h"
 #include "df/unit.h"
 #include "df/item.h"
 #include "df/world.h"
+#include "df/ui.h"
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -1522,6 +1529,7 @@ void DFHack::Lua::Event::Make(lua_State *state, void *key, Owner *owner)
 void DFHack::Lua::Notification::invoke(color_ostream &out, int nargs)
 {
     assert(state);
+    ProfileScope scope("event", name ? name : "");
     Event::Invoke(out, state, key, nargs);
 }
 
@@ -1543,6 +1551,397 @@ void DFHack::Lua::Notification::bind(lua_State *state, const char *name)
 
     this->state = state;
     this->key = this;
+    this->name = name;
+}
+
+/*****************************
+ *  Binary value encoding    *
+ *****************************/
+
+/*
+ * Values are encoded as a subset of msgpack: nil, booleans,
+ * numbers, strings, and tables. Tables that are proper sequences
+ * become arrays, others become maps. Everything is big-endian.
+ */
+
+static const int MAX_ENCODE_DEPTH = 64;
+
+namespace {
+    struct value_encoder {
+        lua_State *L;
+        std::string *out;
+        std::string error;
+
+        void put_byte(uint8_t v) { out->push_back(char(v)); }
+        void put_be(uint64_t v, int bytes) {
+            for (int i = bytes-1; i >= 0; i--)
+                put_byte(uint8_t(v >> (i*8)));
+        }
+
+        void put_header(uint8_t fix, int fix_max, uint8_t tag16, uint8_t tag32, size_t len) {
+            if (len <= size_t(fix_max))
+                put_byte(fix | uint8_t(len));
+            else if (len <= 0xFFFF)
+                { put_byte(tag16); put_be(len, 2); }
+            else
+                { put_byte(tag32); put_be(len, 4); }
+        }
+
+        void put_number(lua_Number v);
+        bool put_table(int idx, int depth);
+        bool put_value(int idx, int depth);
+    };
+
+    struct value_decoder {
+        lua_State *L;
+        const uint8_t *ptr, *end;
+        std::string error;
+
+        bool need(size_t cnt) {
+            if (size_t(end - ptr) >= cnt)
+                return true;
+            error = "unexpected end of data";
+            return false;
+        }
+        uint64_t get_be(int bytes) {
+            uint64_t v = 0;
+            for (int i = 0; i < bytes; i++)
+                v = (v << 8) | *ptr++;
+            return v;
+        }
+
+        bool get_string(size_t len);
+        bool get_array(size_t len, int depth);
+        bool get_map(size_t len, int depth);
+        bool get_value(int depth);
+    };
+}
+
+void value_encoder::put_number(lua_Number v)
+{
+    if (v == floor(v) && fabs(v) < 9007199254740992.0)
+    {
+        if (v >= 0)
+        {
+            uint64_t uv = uint64_t(v);
+            if (uv < 128) put_byte(uint8_t(uv));
+            else if (uv <= 0xFF) { put_byte(0xcc); put_be(uv, 1); }
+            else if (uv <= 0xFFFF) { put_byte(0xcd); put_be(uv, 2); }
+            else if (uv <= 0xFFFFFFFFULL) { put_byte(0xce); put_be(uv, 4); }
+            else { put_byte(0xcf); put_be(uv, 8); }
+        }
+        else
+        {
+            int64_t iv = int64_t(v);
+            if (iv >= -32) put_byte(uint8_t(iv));
+            else if (iv >= -128) { put_byte(0xd0); put_be(uint64_t(iv), 1); }
+            else if (iv >= -32768) { put_byte(0xd1); put_be(uint64_t(iv), 2); }
+            else if (iv >= -2147483647LL-1) { put_byte(0xd2); put_be(uint64_t(iv), 4); }
+            else { put_byte(0xd3); put_be(uint64_t(iv), 8); }
+        }
+    }
+    else
+    {
+        double dv = v;
+        uint64_t bits;
+        memcpy(&bits, &dv, sizeof(bits));
+        put_byte(0xcb);
+        put_be(bits, 8);
+    }
+}
+
+bool value_encoder::put_table(int idx, int depth)
+{
+    size_t len = lua_rawlen(L, idx);
+    size_t count = 0;
+
+    lua_pushnil(L);
+    while (lua_next(L, idx))
+    {
+        lua_pop(L, 1);
+        count++;
+    }
+
+    if (count == len)
+    {
+        put_header(0x90, 15, 0xdc, 0xdd, len);
+
+        for (size_t i = 1; i <= len; i++)
+        {
+            lua_rawgeti(L, idx, i);
+            bool ok = put_value(lua_gettop(L), depth+1);
+            lua_pop(L, 1);
+            if (!ok)
+                return false;
+        }
+    }
+    else
+    {
+        put_header(0x80, 15, 0xde, 0xdf, count);
+
+        lua_pushnil(L);
+        while (lua_next(L, idx))
+        {
+            int top = lua_gettop(L);
+            if (!put_value(top-1, depth+1) || !put_value(top, depth+1))
+            {
+                lua_pop(L, 2);
+                return false;
+            }
+            lua_pop(L, 1);
+        }
+    }
+
+    return true;
+}
+
+bool value_encoder::put_value(int idx, int depth)
+{
+    if (depth > MAX_ENCODE_DEPTH)
+    {
+        error = "nesting too deep";
+        return false;
+    }
+
+    switch (lua_type(L, idx))
+    {
+    case LUA_TNIL:
+        put_byte(0xc0);
+        return true;
+
+    case LUA_TBOOLEAN:
+        put_byte(lua_toboolean(L, idx) ? 0xc3 : 0xc2);
+        return true;
+
+    case LUA_TNUMBER:
+        put_number(lua_tonumber(L, idx));
+        return true;
+
+    case LUA_TSTRING:
+        {
+            size_t len;
+            const char *str = lua_tolstring(L, idx, &len);
+
+            if (len < 32)
+                put_byte(0xa0 | uint8_t(len));
+            else if (len <= 0xFF)
+                { put_byte(0xd9); put_be(len, 1); }
+            else
+                put_header(0xa0, 31, 0xda, 0xdb, len);
+
+            out->append(str, len);
+            return true;
+        }
+
+    case LUA_TTABLE:
+        if (!lua_checkstack(L, 4))
+        {
+            error = "out of stack space";
+            return false;
+        }
+        return put_table(idx, depth);
+
+    default:
+        error = stl_sprintf("cannot encode a %s value", luaL_typename(L, idx));
+        return false;
+    }
+}
+
+bool value_decoder::get_string(size_t len)
+{
+    if (!need(len))
+        return false;
+
+    lua_pushlstring(L, (const char*)ptr, len);
+    ptr += len;
+    return true;
+}
+
+bool value_decoder::get_array(size_t len, int depth)
+{
+    lua_createtable(L, std::min(len, size_t(end - ptr)), 0);
+
+    for (size_t i = 1; i <= len; i++)
+    {
+        if (!get_value(depth+1))
+            return false;
+        lua_rawseti(L, -2, i);
+    }
+
+    return true;
+}
+
+bool value_decoder::get_map(size_t len, int depth)
+{
+    lua_createtable(L, 0, std::min(len, size_t(end - ptr)));
+
+    for (size_t i = 0; i < len; i++)
+    {
+        if (!get_value(depth+1) || !get_value(depth+1))
+            return false;
+
+        if (lua_isnil(L, -2))
+        {
+            error = "nil table key";
+            return false;
+        }
+
+        if (lua_type(L, -2) == LUA_TNUMBER && lua_tonumber(L, -2) != lua_tonumber(L, -2))
+        {
+            error = "NaN table key";
+            return false;
+        }
+
+        lua_rawset(L, -3);
+    }
+
+    return true;
+}
+
+bool value_decoder::get_value(int depth)
+{
+    if (depth > MAX_ENCODE_DEPTH)
+    {
+        error = "nesting too deep";
+        return false;
+    }
+    if (!lua_checkstack(L, 4))
+    {
+        error = "out of stack space";
+        return false;
+    }
+    if (!need(1))
+        return false;
+
+    uint8_t tag = *ptr++;
+
+    if (tag < 0x80)
+    {
+        lua_pushinteger(L, tag);
+        return true;
+    }
+    if (tag >= 0xe0)
+    {
+        lua_pushinteger(L, int8_t(tag));
+        return true;
+    }
+    if ((tag & 0xf0) == 0x80)
+        return get_map(tag & 0x0f, depth);
+    if ((tag & 0xf0) == 0x90)
+        return get_array(tag & 0x0f, depth);
+    if ((tag & 0xe0) == 0xa0)
+        return get_string(tag & 0x1f);
+
+    switch (tag)
+    {
+    case 0xc0: lua_pushnil(L); return true;
+    case 0xc2: lua_pushboolean(L, false); return true;
+    case 0xc3: lua_pushboolean(L, true); return true;
+
+    case 0xc4: case 0xd9: return need(1) && get_string(get_be(1));
+    case 0xc5: case 0xda: return need(2) && get_string(get_be(2));
+    case 0xc6: case 0xdb: return need(4) && get_string(get_be(4));
+
+    case 0xca:
+        if (!need(4)) return false;
+        {
+            uint32_t bits = get_be(4);
+            float fv;
+            memcpy(&fv, &bits, sizeof(fv));
+            lua_pushnumber(L, fv);
+        }
+        return true;
+    case 0xcb:
+        if (!need(8)) return false;
+        {
+            uint64_t bits = get_be(8);
+            double dv;
+            memcpy(&dv, &bits, sizeof(dv));
+            lua_pushnumber(L, dv);
+        }
+        return true;
+
+    case 0xcc: if (!need(1)) return false; lua_pushnumber(L, lua_Number(get_be(1))); return true;
+    case 0xcd: if (!need(2)) return false; lua_pushnumber(L, lua_Number(get_be(2))); return true;
+    case 0xce: if (!need(4)) return false; lua_pushnumber(L, lua_Number(get_be(4))); return true;
+    case 0xcf: if (!need(8)) return false; lua_pushnumber(L, lua_Number(get_be(8))); return true;
+    case 0xd0: if (!need(1)) return false; lua_pushnumber(L, lua_Number(int8_t(get_be(1)))); return true;
+    case 0xd1: if (!need(2)) return false; lua_pushnumber(L, lua_Number(int16_t(get_be(2)))); return true;
+    case 0xd2: if (!need(4)) return false; lua_pushnumber(L, lua_Number(int32_t(get_be(4)))); return true;
+    case 0xd3: if (!need(8)) return false; lua_pushnumber(L, lua_Number(int64_t(get_be(8)))); return true;
+
+    case 0xdc: return need(2) && get_array(get_be(2), depth);
+    case 0xdd: return need(4) && get_array(get_be(4), depth);
+    case 0xde: return need(2) && get_map(get_be(2), depth);
+    case 0xdf: return need(4) && get_map(get_be(4), depth);
+
+    default:
+        error = stl_sprintf("unsupported type tag 0x%02x", tag);
+        return false;
+    }
+}
+
+bool DFHack::Lua::EncodeValue(lua_State *state, int val_index, std::string *out, std::string *error)
+{
+    value_encoder enc;
+    enc.L = state;
+    enc.out = out;
+
+    out->clear();
+
+    if (enc.put_value(lua_absindex(state, val_index), 0))
+        return true;
+
+    if (error)
+        *error = enc.error;
+    return false;
+}
+
+bool DFHack::Lua::DecodeValue(lua_State *state, const char *data, size_t size, std::string *error)
+{
+    int top = lua_gettop(state);
+
+    value_decoder dec;
+    dec.L = state;
+    dec.ptr = (const uint8_t*)data;
+    dec.end = dec.ptr + size;
+
+    if (dec.get_value(0))
+    {
+        if (dec.ptr == dec.end)
+            return true;
+
+        dec.error = "trailing data";
+    }
+
+    lua_settop(state, top);
+    if (error)
+        *error = dec.error;
+    return false;
+}
+
+static int dfhack_rpc_encode(lua_State *L)
+{
+    luaL_checkany(L, 1);
+
+    std::string data, error;
+    if (!Lua::EncodeValue(L, 1, &data, &error))
+        luaL_error(L, "%s", error.c_str());
+
+    lua_pushlstring(L, data.data(), data.size());
+    return 1;
+}
+
+static int dfhack_rpc_decode(lua_State *L)
+{
+    size_t size;
+    const char *data = luaL_checklstring(L, 1, &size);
+
+    std::string error;
+    if (!Lua::DecodeValue(L, data, size, &error))
+        luaL_error(L, "%s", error.c_str());
+
+    return 1;
 }
 
 /************************
@@ -1550,6 +1949,8 @@ void DFHack::Lua::Notification::bind(lua_State *state, const char *name)
  ************************/
 
 void OpenDFHackApi(lua_State *state);
+void OpenLuaWorkers(lua_State *state);
+void RunLuaWorkerEvents(color_ostream &out, lua_State *state);
 
 namespace DFHack { namespace Lua { namespace Core {
     static void InitCoreContext();
@@ -1672,10 +2073,107 @@ lua_State *DFHack::Lua::Open(color_ostream &out, lua_State *state)
     return state;
 }
 
+/*
+ * Timers are kept in binary min-heaps ordered by due time and id,
+ * with an index of id -> heap position so that they can be
+ * cancelled in O(log n).
+ */
+
+struct TimerEntry {
+    int due;
+    int id;
+    int period; // 0 for one-shot timers
+
+    bool operator< (const TimerEntry &other) const {
+        return due < other.due || (due == other.due && id < other.id);
+    }
+};
+
+class TimerHeap {
+    std::vector<TimerEntry> heap;
+    std::map<int,size_t> index;
+
+    void place(size_t pos, const TimerEntry &entry) {
+        heap[pos] = entry;
+        index[entry.id] = pos;
+    }
+
+    void sift_up(size_t pos) {
+        TimerEntry entry = heap[pos];
+        while (pos > 0)
+        {
+            size_t parent = (pos-1)/2;
+            if (!(entry < heap[parent]))
+                break;
+            place(pos, heap[parent]);
+            pos = parent;
+        }
+        place(pos, entry);
+    }
+
+    void sift_down(size_t pos) {
+        TimerEntry entry = heap[pos];
+        for (;;)
+        {
+            size_t child = pos*2+1;
+            if (child >= heap.size())
+                break;
+            if (child+1 < heap.size() && heap[child+1] < heap[child])
+                child++;
+            if (!(heap[child] < entry))
+                break;
+            place(pos, heap[child]);
+            pos = child;
+        }
+        place(pos, entry);
+    }
+
+    void remove_at(size_t pos) {
+        index.erase(heap[pos].id);
+
+        TimerEntry last = heap.back();
+        heap.pop_back();
+        if (pos >= heap.size())
+            return;
+
+        place(pos, last);
+        if (pos > 0 && last < heap[(pos-1)/2])
+            sift_up(pos);
+        else
+            sift_down(pos);
+    }
+
+public:
+    bool empty() const { return heap.empty(); }
+    size_t size() const { return heap.size(); }
+    const TimerEntry &top() const { return heap.front(); }
+    const std::vector<TimerEntry> &entries() const { return heap; }
+
+    void push(const TimerEntry &entry) {
+        heap.push_back(entry);
+        sift_up(heap.size()-1);
+    }
+
+    void pop() { remove_at(0); }
+
+    bool remove(int id) {
+        auto it = index.find(id);
+        if (it == index.end())
+            return false;
+        remove_at(it->second);
+        return true;
+    }
+
+    void clear() {
+        heap.clear();
+        index.clear();
+    }
+};
+
 static int next_timeout_id = 0;
 static int frame_idx = 0;
-static std::multimap<int,int> frame_timers;
-static std::multimap<int,int> tick_timers;
+static TimerHeap frame_timers;
+static TimerHeap tick_timers;
 
 int DFHACK_TIMEOUTS_TOKEN = 0;
 
@@ -1683,24 +2181,8 @@ static const char *const timeout_modes[] = {
     "frames", "ticks", "days", "months", "years", NULL
 };
 
-int dfhack_timeout(lua_State *L)
+static int timeout_delta(lua_State *L, lua_Number time, int mode)
 {
-    using df::global::world;
-    using df::global::enabler;
-
-    // Parse arguments
-    lua_Number time = luaL_checknumber(L, 1);
-    int mode = luaL_checkoption(L, 2, NULL, timeout_modes);
-    luaL_checktype(L, 3, LUA_TFUNCTION);
-    lua_settop(L, 3);
-
-    if (mode > 0 && !Core::getInstance().isWorldLoaded())
-    {
-        lua_pushnil(L);
-        return 1;
-    }
-
-    // Compute timeout value
     switch (mode)
     {
     case 2:
@@ -1720,30 +2202,71 @@ int dfhack_timeout(lua_State *L)
     if (delta <= 0)
         luaL_error(L, "Invalid timeout: %d", delta);
 
-    // Queue the timeout
-    int id = next_timeout_id++;
+    return delta;
+}
+
+/*
+ * Queues the value on top of the stack (a callback, or a sleeping
+ * coroutine) to be run after delta frames or ticks, and pops it.
+ */
+static int queue_timeout(lua_State *L, int delta, int mode, bool repeat)
+{
+    using df::global::world;
+
+    TimerEntry entry;
+    entry.id = next_timeout_id++;
+    entry.period = repeat ? delta : 0;
+
     if (mode)
-        tick_timers.insert(std::pair<int,int>(world->frame_counter+delta, id));
+    {
+        entry.due = world->frame_counter+delta;
+        tick_timers.push(entry);
+    }
     else
-        frame_timers.insert(std::pair<int,int>(frame_idx+delta, id));
+    {
+        entry.due = frame_idx+delta;
+        frame_timers.push(entry);
+    }
 
     lua_rawgetp(L, LUA_REGISTRYINDEX, &DFHACK_TIMEOUTS_TOKEN);
     lua_swap(L);
-    lua_rawseti(L, -2, id);
+    lua_rawseti(L, -2, entry.id);
+    lua_pop(L, 1);
 
-    lua_pushinteger(L, id);
-    return 1;
+    return entry.id;
 }
 
-int dfhack_timeout_active(lua_State *L)
+int dfhack_timeout(lua_State *L)
 {
-    int id = luaL_optint(L, 1, -1);
-    bool set_cb = (lua_gettop(L) >= 2);
-    lua_settop(L, 2);
-    if (!lua_isnil(L, 2))
-        luaL_checktype(L, 2, LUA_TFUNCTION);
-
-    if (id < 0)
+    // Parse arguments
+    lua_Number time = luaL_checknumber(L, 1);
+    int mode = luaL_checkoption(L, 2, NULL, timeout_modes);
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+    bool repeat = lua_toboolean(L, 4);
+    lua_settop(L, 3);
+
+    if (mode > 0 && !Core::getInstance().isWorldLoaded())
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    // Queue the timeout
+    int delta = timeout_delta(L, time, mode);
+
+    lua_pushinteger(L, queue_timeout(L, delta, mode, repeat));
+    return 1;
+}
+
+int dfhack_timeout_active(lua_State *L)
+{
+    int id = luaL_optint(L, 1, -1);
+    bool set_cb = (lua_gettop(L) >= 2);
+    lua_settop(L, 2);
+    if (!lua_isnil(L, 2))
+        luaL_checktype(L, 2, LUA_TFUNCTION);
+
+    if (id < 0)
     {
         lua_pushnil(L);
         return 1;
@@ -1755,79 +2278,967 @@ int dfhack_timeout_active(lua_State *L)
     {
         lua_pushvalue(L, 2);
         lua_rawseti(L, 3, id);
+
+        // Cancelled timers are removed from the queue immediately
+        if (lua_isnil(L, 2) && !frame_timers.remove(id))
+            tick_timers.remove(id);
     }
     return 1;
 }
 
-static void cancel_timers(std::multimap<int,int> &timers)
+/*
+ * Coroutine scheduling. dfhack.sleep, dfhack.await_event and
+ * dfhack.await_state_change suspend the calling coroutine; sleeping
+ * coroutines are stored in the timer queues, and the others are moved
+ * to a ready queue when their event happens. Both are resumed in bulk
+ * from Lua::Core::onUpdate.
+ */
+
+static int DFHACK_ASYNC_READY_TOKEN = 0;
+static int DFHACK_STATE_WAITERS_TOKEN = 0;
+static int DFHACK_EVENT_WAITERS_TOKEN = 0;
+static int DFHACK_ASYNC_CANCEL_TOKEN = 0;
+
+// The ready queue stores thread, argument count, arguments... in a row
+static int async_ready_len = 0;
+
+/*
+ * EventManager only advances its cursors while a type has listeners, so
+ * one listener per type stays registered from map load to unload, and
+ * is only made more frequent while coroutines wait for that type.
+ */
+static const int EVENT_IDLE_FREQ = 100;
+static int event_listen_freq[EventManager::EventType::EVENT_MAX];
+
+static const char *const await_event_types[] = {
+    "JOB_INITIATED", "JOB_COMPLETED", "UNIT_DEATH", "ITEM_CREATED", "BUILDING",
+    "CONSTRUCTION", "SYNDROME", "INVASION", "INVENTORY_CHANGE", NULL
+};
+
+static void check_coroutine(lua_State *L, const char *fn)
 {
-    using Lua::Core::State;
+    if (lua_pushthread(L))
+        luaL_error(L, "%s must be called from a coroutine", fn);
+    lua_pop(L, 1);
+}
 
-    Lua::StackUnwinder frame(State);
-    lua_rawgetp(State, LUA_REGISTRYINDEX, &DFHACK_TIMEOUTS_TOKEN);
+/*
+ * Resumes the thread below nargs arguments on the stack, and pops it.
+ * Errors in the coroutine are rethrown with its traceback.
+ */
+static void resume_waiter(lua_State *L, int nargs)
+{
+    lua_State *co = lua_tothread(L, -nargs-1);
+
+    if (!Lua::IsSuccess(resume_helper(L, co, nargs, 0)))
+        lua_error(L);
+
+    lua_pop(L, 1);
+}
+
+static void append_ready(lua_State *L, int ready, int thread, int first, int nargs)
+{
+    lua_pushvalue(L, thread);
+    lua_rawseti(L, ready, ++async_ready_len);
+    lua_pushinteger(L, nargs);
+    lua_rawseti(L, ready, ++async_ready_len);
+
+    for (int i = 0; i < nargs; i++)
+    {
+        lua_pushvalue(L, first+i);
+        lua_rawseti(L, ready, ++async_ready_len);
+    }
+}
+
+/*
+ * Continuation of dfhack.sleep and dfhack.await_event: returns the values
+ * the coroutine was resumed with, or raises the error that follows the
+ * cancel marker.
+ */
+static int async_wait_cont(lua_State *L)
+{
+    int base = 0;
+    lua_getctx(L, &base);
+
+    if (lua_gettop(L) > base && lua_touserdata(L, base+1) == &DFHACK_ASYNC_CANCEL_TOKEN)
+        luaL_error(L, "%s", lua_tostring(L, base+2));
+
+    return lua_gettop(L) - base;
+}
+
+static int async_wait(lua_State *L)
+{
+    return lua_yieldk(L, 0, lua_gettop(L), async_wait_cont);
+}
+
+static int dfhack_async(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    int nargs = lua_gettop(L) - 1;
+
+    lua_pushvalue(L, 1);
+    lua_State *co = Lua::NewCoroutine(L);
+    lua_replace(L, 1);
+
+    if (!Lua::IsSuccess(resume_helper(L, co, nargs, 0)))
+        return lua_error(L);
+
+    return 1;
+}
+
+static int dfhack_sleep(lua_State *L)
+{
+    lua_Number time = luaL_checknumber(L, 1);
+    int mode = luaL_checkoption(L, 2, "ticks", timeout_modes);
+    check_coroutine(L, "dfhack.sleep");
+
+    if (mode > 0 && !Core::getInstance().isWorldLoaded())
+        luaL_error(L, "cannot sleep for %s: world not loaded", timeout_modes[mode]);
+
+    int delta = timeout_delta(L, time, mode);
+
+    lua_pushthread(L);
+    queue_timeout(L, delta, mode, false);
+    return async_wait(L);
+}
+
+static int dfhack_await_state_change(lua_State *L)
+{
+    int code = luaL_optint(L, 1, -1);
+    check_coroutine(L, "dfhack.await_state_change");
+
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &DFHACK_STATE_WAITERS_TOKEN);
+    lua_pushthread(L);
+    lua_pushinteger(L, code);
+    lua_rawset(L, -3);
+    return lua_yield(L, 0);
+}
+
+static void wake_state_waiters(lua_State *L, int code)
+{
+    Lua::StackUnwinder frame(L);
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &DFHACK_STATE_WAITERS_TOKEN);
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &DFHACK_ASYNC_READY_TOKEN);
+    lua_pushinteger(L, code);
+
+    lua_pushnil(L);
+    while (lua_next(L, frame[1]))
+    {
+        int filter = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+
+        if (filter >= 0 && filter != code)
+            continue;
+
+        append_ready(L, frame[2], lua_gettop(L), frame[3], 1);
+
+        // Clearing existing fields is allowed during traversal
+        lua_pushvalue(L, -1);
+        lua_pushnil(L);
+        lua_rawset(L, frame[1]);
+    }
+}
+
+/*
+ * The data of EventManager events is copied into plain values,
+ * since the coroutines are resumed after the handler returns.
+ */
+static int push_event_data(lua_State *L, int type, void *data)
+{
+    using namespace EventManager;
+
+    switch (type)
+    {
+    case EventType::JOB_INITIATED:
+    case EventType::JOB_COMPLETED:
+        lua_pushinteger(L, ((df::job*)data)->id);
+        return 1;
+
+    case EventType::CONSTRUCTION:
+        return Lua::PushPosXYZ(L, ((df::construction*)data)->pos);
+
+    case EventType::SYNDROME:
+    {
+        auto syndrome = (SyndromeData*)data;
+        lua_pushinteger(L, syndrome->unitId);
+        lua_pushinteger(L, syndrome->syndromeIndex);
+        return 2;
+    }
+
+    case EventType::INVENTORY_CHANGE:
+    {
+        auto change = (InventoryChangeData*)data;
+        auto item = change->item_new ? change->item_new : change->item_old;
+        lua_pushinteger(L, change->unitId);
+        lua_pushinteger(L, item ? item->itemId : -1);
+        lua_pushboolean(L, change->item_old != NULL);
+        lua_pushboolean(L, change->item_new != NULL);
+        return 4;
+    }
+
+    default:
+        // Unit, item, building and invasion ids
+        lua_pushinteger(L, (intptr_t)data);
+        return 1;
+    }
+}
+
+static void listen_event(int type, int freq);
+
+/*
+ * Returns the id cursor matching events of the type, and the id of the
+ * event: ids below the cursor recorded when a coroutine started waiting
+ * belong to events that happened before. Other types return -1.
+ */
+static int event_id_cursor(int type)
+{
+    using namespace EventManager;
+
+    switch (type)
+    {
+    case EventType::JOB_INITIATED:
+        return df::global::job_next_id ? *df::global::job_next_id : -1;
+    case EventType::ITEM_CREATED:
+        return df::global::item_next_id ? *df::global::item_next_id : -1;
+    case EventType::INVASION:
+        return df::global::ui ? df::global::ui->invasions.next_id : -1;
+    default:
+        return -1;
+    }
+}
+
+static int event_id(int type, void *data)
+{
+    using namespace EventManager;
+
+    switch (type)
+    {
+    case EventType::JOB_INITIATED:
+        return ((df::job*)data)->id;
+    case EventType::ITEM_CREATED:
+    case EventType::INVASION:
+        return (intptr_t)data;
+    default:
+        return -1;
+    }
+}
+
+static void wake_event_waiters(int type, void *data)
+{
+    lua_State *L = Lua::Core::State;
+    Lua::StackUnwinder frame(L);
+
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &DFHACK_EVENT_WAITERS_TOKEN);
+    lua_rawgeti(L, frame[1], type);
+    if (!lua_istable(L, frame[2]))
+        return;
+
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &DFHACK_ASYNC_READY_TOKEN);
+    int nargs = push_event_data(L, type, data);
+    int id = event_id(type, data);
+    bool waiting = false;
+
+    lua_pushnil(L);
+    while (lua_next(L, frame[2]))
+    {
+        // Skip events older than the wait
+        if (lua_isnumber(L, -1) && id < lua_tointeger(L, -1))
+        {
+            lua_pop(L, 1);
+            waiting = true;
+            continue;
+        }
+
+        lua_pop(L, 1);
+        append_ready(L, frame[3], lua_gettop(L), frame[4], nargs);
+
+        // Clearing existing fields is allowed during traversal
+        lua_pushvalue(L, -1);
+        lua_pushnil(L);
+        lua_rawset(L, frame[2]);
+    }
+
+    if (waiting)
+        return;
+
+    lua_pushnil(L);
+    lua_rawseti(L, frame[1], type);
+
+    // Handlers are called on a copy of the listener list, so this is safe
+    listen_event(type, EVENT_IDLE_FREQ);
+}
+
+template<int type>
+static void await_event_cb(color_ostream &out, void *data)
+{
+    wake_event_waiters(type, data);
+}
+
+static const EventManager::EventHandler::callback_t await_event_callbacks[] = {
+    NULL,
+    await_event_cb<EventManager::EventType::JOB_INITIATED>,
+    await_event_cb<EventManager::EventType::JOB_COMPLETED>,
+    await_event_cb<EventManager::EventType::UNIT_DEATH>,
+    await_event_cb<EventManager::EventType::ITEM_CREATED>,
+    await_event_cb<EventManager::EventType::BUILDING>,
+    await_event_cb<EventManager::EventType::CONSTRUCTION>,
+    await_event_cb<EventManager::EventType::SYNDROME>,
+    await_event_cb<EventManager::EventType::INVASION>,
+    await_event_cb<EventManager::EventType::INVENTORY_CHANGE>,
+};
+
+static void listen_event(int type, int freq)
+{
+    using namespace EventManager;
+
+    int &cur = event_listen_freq[type];
+    if (cur == freq)
+        return;
+
+    if (cur > 0)
+        unregister(EventType::EventType(type), EventHandler(await_event_callbacks[type], cur), NULL);
+
+    cur = freq;
+
+    if (cur > 0)
+        registerListener(EventType::EventType(type), EventHandler(await_event_callbacks[type], cur), NULL);
+}
+
+static void listen_all_events(int freq)
+{
+    for (int type = 1; type < EventManager::EventType::EVENT_MAX; type++)
+        listen_event(type, freq);
+}
+
+static int dfhack_await_event(lua_State *L)
+{
+    int type = luaL_checkoption(L, 1, NULL, await_event_types) + 1;
+    int freq = luaL_optint(L, 2, 1);
+    luaL_argcheck(L, freq > 0, 2, "positive frequency expected");
+    check_coroutine(L, "dfhack.await_event");
+
+    if (!Core::getInstance().isMapLoaded())
+        luaL_error(L, "cannot wait for %s: map not loaded", await_event_types[type-1]);
+
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &DFHACK_EVENT_WAITERS_TOKEN);
+    lua_rawgeti(L, -1, type);
+    if (lua_isnil(L, -1))
+    {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, -3, type);
+    }
+
+    lua_pushthread(L);
+    int cursor = event_id_cursor(type);
+    if (cursor >= 0)
+        lua_pushinteger(L, cursor);
+    else
+        lua_pushboolean(L, true);
+    lua_rawset(L, -3);
+
+    int cur = event_listen_freq[type];
+    listen_event(type, cur > 0 ? std::min(cur, freq) : freq);
+    return async_wait(L);
+}
+
+/*
+ * Clears the tick timers and event waiters on map unload. Coroutines
+ * waiting in dfhack.sleep or dfhack.await_event are made ready with the
+ * cancel marker, so that the call raises an error in them, and their
+ * cleanup code runs.
+ */
+static void cancel_waiters(lua_State *L)
+{
+    Lua::StackUnwinder frame(L);
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &DFHACK_TIMEOUTS_TOKEN);
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &DFHACK_ASYNC_READY_TOKEN);
+    lua_pushlightuserdata(L, &DFHACK_ASYNC_CANCEL_TOKEN);
+    lua_pushstring(L, "map unloaded");
+
+    auto &entries = tick_timers.entries();
+    for (auto it = entries.begin(); it != entries.end(); ++it)
+    {
+        lua_rawgeti(L, frame[1], it->id);
+        if (lua_isthread(L, -1))
+            append_ready(L, frame[2], lua_gettop(L), frame[3], 2);
+        lua_pop(L, 1);
+
+        lua_pushnil(L);
+        lua_rawseti(L, frame[1], it->id);
+    }
+
+    tick_timers.clear();
+
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &DFHACK_EVENT_WAITERS_TOKEN);
+    for (int type = 1; type < EventManager::EventType::EVENT_MAX; type++)
+    {
+        lua_rawgeti(L, frame[5], type);
+        if (lua_istable(L, -1))
+        {
+            lua_pushnil(L);
+            while (lua_next(L, -2))
+            {
+                lua_pop(L, 1);
+                append_ready(L, frame[2], lua_gettop(L), frame[3], 2);
+            }
+        }
+        lua_pop(L, 1);
+    }
+
+    lua_newtable(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &DFHACK_EVENT_WAITERS_TOKEN);
+
+    listen_all_events(0);
+}
+
+static const luaL_Reg dfhack_async_funcs[] = {
+    { "async", dfhack_async },
+    { "sleep", dfhack_sleep },
+    { "await_event", dfhack_await_event },
+    { "await_state_change", dfhack_await_state_change },
+    { NULL, NULL }
+};
+
+/*
+ * Sampling profiler for the core context, driven by a count hook.
+ * Samples are aggregated as collapsed stacks (outermost frame first,
+ * prefixed by the owner label), by function and by source line.
+ */
+
+static bool profile_active = false;
+static int profile_count = 0;
+static uint64_t profile_samples = 0;
+static std::vector<std::string> profile_owners;
+static std::map<std::string, unsigned> profile_stacks;
+static std::map<std::string, unsigned> profile_functions;
+static std::map<std::string, unsigned> profile_lines;
+
+DFHack::Lua::ProfileScope::ProfileScope(const char *kind, const std::string &name)
+{
+    active = profile_active;
+    if (active)
+        profile_owners.push_back(name.empty() ? std::string(kind) : kind + (":" + name));
+}
+
+DFHack::Lua::ProfileScope::~ProfileScope()
+{
+    if (active && !profile_owners.empty())
+        profile_owners.pop_back();
+}
+
+static std::string profile_frame_name(lua_Debug &info)
+{
+    if (*info.what == 'C')
+        return std::string("[C]:") + (info.name ? info.name : "?");
+    if (*info.what == 'm')
+        return std::string(info.short_src) + ":main";
 
-    for (auto it = timers.begin(); it != timers.end(); ++it)
+    return stl_sprintf("%s:%s:%d", info.short_src, info.name ? info.name : "?",
+                       info.linedefined);
+}
+
+static void profile_hook(lua_State *L, lua_Debug *)
+{
+    // Coroutines that inherited the hook keep it after stop
+    if (!profile_active)
     {
-        lua_pushnil(State);
-        lua_rawseti(State, frame[1], it->second);
+        lua_sethook(L, NULL, 0, 0);
+        return;
     }
 
-    timers.clear();
+    lua_Debug info;
+    std::vector<std::string> frames;
+
+    for (int level = 0; lua_getstack(L, level, &info); level++)
+    {
+        if (!lua_getinfo(L, "Sln", &info))
+            break;
+
+        frames.push_back(profile_frame_name(info));
+
+        if (level == 0)
+        {
+            profile_functions[frames.back()]++;
+            if (info.currentline > 0)
+                profile_lines[stl_sprintf("%s:%d", info.short_src, info.currentline)]++;
+        }
+    }
+
+    if (frames.empty())
+        return;
+
+    // Collapsed stack format: owner;outer;...;inner
+    std::string stack = profile_owners.empty() ? "core" : profile_owners.back();
+    for (size_t i = frames.size(); i > 0; i--)
+        stack += ";" + frames[i-1];
+
+    profile_stacks[stack]++;
+    profile_samples++;
+}
+
+static int dfhack_internal_profileStart(lua_State *L)
+{
+    int count = luaL_optint(L, 1, 10000);
+    luaL_argcheck(L, count > 0, 1, "positive instruction count expected");
+
+    profile_samples = 0;
+    profile_stacks.clear();
+    profile_functions.clear();
+    profile_lines.clear();
+
+    profile_active = true;
+    profile_count = count;
+
+    // Coroutines created from now on inherit the hook
+    lua_sethook(Lua::Core::State, profile_hook, LUA_MASKCOUNT, count);
+    if (L != Lua::Core::State)
+        lua_sethook(L, profile_hook, LUA_MASKCOUNT, count);
+    return 0;
+}
+
+static int dfhack_internal_profileStop(lua_State *L)
+{
+    profile_active = false;
+    profile_owners.clear();
+
+    lua_sethook(Lua::Core::State, NULL, 0, 0);
+    if (L != Lua::Core::State)
+        lua_sethook(L, NULL, 0, 0);
+    return 0;
 }
 
+static void push_profile_table(lua_State *L, const std::map<std::string, unsigned> &data)
+{
+    lua_createtable(L, 0, data.size());
+    for (auto it = data.begin(); it != data.end(); ++it)
+    {
+        lua_pushinteger(L, it->second);
+        lua_setfield(L, -2, it->first.c_str());
+    }
+}
+
+static int dfhack_internal_getProfile(lua_State *L)
+{
+    lua_newtable(L);
+    lua_pushboolean(L, profile_active);
+    lua_setfield(L, -2, "active");
+    lua_pushinteger(L, profile_count);
+    lua_setfield(L, -2, "count");
+    lua_pushnumber(L, profile_samples);
+    lua_setfield(L, -2, "samples");
+    push_profile_table(L, profile_stacks);
+    lua_setfield(L, -2, "stacks");
+    push_profile_table(L, profile_functions);
+    lua_setfield(L, -2, "functions");
+    push_profile_table(L, profile_lines);
+    lua_setfield(L, -2, "lines");
+    return 1;
+}
+
+/*
+ * Garbage collection of the core context is driven from the frame loop:
+ * every frame performs an incremental step of a fixed size, and a full
+ * collection is only done when the map or world is unloaded. The automatic
+ * collector is kept as a fallback with a high pause, so that it only kicks
+ * in if the frame steps cannot keep up with allocation.
+ */
+
+static int gc_step_kb = 0;
+static int gc_default_pause = 200;
+static const int GC_FALLBACK_PAUSE = 400;
+
+static struct {
+    uint64_t steps, cycles, full_collections;
+    uint64_t last_step_us, max_step_us, total_step_us;
+    uint64_t last_full_us;
+} gc_stats;
+
+static void set_gc_step(lua_State *L, int step_kb)
+{
+    gc_step_kb = std::max(0, step_kb);
+    lua_gc(L, LUA_GCSETPAUSE, gc_step_kb > 0 ? GC_FALLBACK_PAUSE : gc_default_pause);
+}
+
+static void init_gc(lua_State *L)
+{
+    gc_default_pause = lua_gc(L, LUA_GCSETPAUSE, gc_default_pause);
+
+    int step_kb = 64;
+    if (const char *env = getenv("DFHACK_LUA_GC_STEP"))
+        step_kb = atoi(env);
+
+    set_gc_step(L, step_kb);
+}
+
+static void step_gc(lua_State *L)
+{
+    if (gc_step_kb <= 0)
+        return;
+
+    uint64_t start = GetTimeUs64();
+    bool finished = lua_gc(L, LUA_GCSTEP, gc_step_kb) != 0;
+    uint64_t time = GetTimeUs64() - start;
+
+    gc_stats.steps++;
+    if (finished)
+        gc_stats.cycles++;
+    gc_stats.last_step_us = time;
+    gc_stats.max_step_us = std::max(gc_stats.max_step_us, time);
+    gc_stats.total_step_us += time;
+}
+
+static void full_gc(lua_State *L)
+{
+    uint64_t start = GetTimeUs64();
+    lua_gc(L, LUA_GCCOLLECT, 0);
+
+    gc_stats.full_collections++;
+    gc_stats.last_full_us = GetTimeUs64() - start;
+}
+
+static int dfhack_internal_setGCStep(lua_State *L)
+{
+    set_gc_step(L, luaL_checkint(L, 1));
+    return 0;
+}
+
+static int dfhack_internal_getGCStats(lua_State *L)
+{
+    lua_newtable(L);
+    lua_pushinteger(L, gc_step_kb);
+    lua_setfield(L, -2, "step_kb");
+    lua_pushinteger(L, lua_gc(L, LUA_GCCOUNT, 0));
+    lua_setfield(L, -2, "heap_kb");
+    lua_pushnumber(L, gc_stats.steps);
+    lua_setfield(L, -2, "steps");
+    lua_pushnumber(L, gc_stats.cycles);
+    lua_setfield(L, -2, "cycles");
+    lua_pushnumber(L, gc_stats.full_collections);
+    lua_setfield(L, -2, "full_collections");
+    lua_pushnumber(L, gc_stats.last_step_us);
+    lua_setfield(L, -2, "last_step_us");
+    lua_pushnumber(L, gc_stats.max_step_us);
+    lua_setfield(L, -2, "max_step_us");
+    lua_pushnumber(L, gc_stats.steps ? double(gc_stats.total_step_us)/gc_stats.steps : 0.0);
+    lua_setfield(L, -2, "avg_step_us");
+    lua_pushnumber(L, gc_stats.last_full_us);
+    lua_setfield(L, -2, "last_full_us");
+    return 1;
+}
+
+static int dfhack_internal_resetGCStats(lua_State *L)
+{
+    memset(&gc_stats, 0, sizeof(gc_stats));
+    return 0;
+}
+
+static const luaL_Reg dfhack_internal_core_funcs[] = {
+    { "setGCStep", dfhack_internal_setGCStep },
+    { "getGCStats", dfhack_internal_getGCStats },
+    { "resetGCStats", dfhack_internal_resetGCStats },
+    { "profileStart", dfhack_internal_profileStart },
+    { "profileStop", dfhack_internal_profileStop },
+    { "getProfile", dfhack_internal_getProfile },
+    { NULL, NULL }
+};
+
 void DFHack::Lua::Core::onStateChange(color_ostream &out, int code) {
     if (!State) return;
 
     switch (code)
     {
+    case SC_MAP_LOADED:
+        listen_all_events(EVENT_IDLE_FREQ);
+        break;
+
     case SC_MAP_UNLOADED:
     case SC_WORLD_UNLOADED:
-        cancel_timers(tick_timers);
+        cancel_waiters(State);
+        LuaWrapper::ClearObjectCache(State);
         break;
 
     default:;
     }
 
     Lua::Push(State, code);
-    Lua::Event::Invoke(out, State, (void*)onStateChange, 1);
+    {
+        ProfileScope scope("onStateChange");
+        Lua::Event::Invoke(out, State, (void*)onStateChange, 1);
+    }
+
+    wake_state_waiters(State, code);
+
+    if (code == SC_MAP_UNLOADED || code == SC_WORLD_UNLOADED)
+        full_gc(State);
 }
 
-static void run_timers(color_ostream &out, lua_State *L,
-                       std::multimap<int,int> &timers, int table, int bound)
+static int *batch_dispatch_pos = NULL;
+
+/*
+ * Runs the timers listed in the array at index 1, up to the count at
+ * index 2, starting after *batch_dispatch_pos; index 3 is the timeout
+ * callback table. Ids of repeating timers are stored as -(id+1).
+ *
+ * The position is advanced before each call, so that after an error
+ * the caller can resume with the next timer.
+ */
+static int dispatch_timers(lua_State *L)
 {
-    while (!timers.empty() && timers.begin()->first <= bound)
+    int count = lua_tointeger(L, 2);
+    int *pos = batch_dispatch_pos;
+
+    while (*pos < count)
     {
-        int id = timers.begin()->second;
-        timers.erase(timers.begin());
+        lua_rawgeti(L, 1, ++*pos);
+        int id = lua_tointeger(L, -1);
+        lua_pop(L, 1);
 
-        lua_rawgeti(L, table, id);
+        bool repeat = (id < 0);
+        if (repeat)
+            id = -id-1;
 
+        // Look up again, since an earlier callback may have cancelled it
+        lua_rawgeti(L, 3, id);
         if (lua_isnil(L, -1))
+        {
             lua_pop(L, 1);
-        else
+            continue;
+        }
+
+        if (!repeat)
         {
             lua_pushnil(L);
-            lua_rawseti(L, table, id);
+            lua_rawseti(L, 3, id);
+        }
 
-            Lua::SafeCall(out, L, 0, 0);
+        // Sleeping coroutines are stored as threads
+        if (lua_isthread(L, -1))
+            resume_waiter(L, 0);
+        else
+            lua_call(L, 0, 0);
+    }
+
+    return 0;
+}
+
+/*
+ * Resumes the coroutines in the ready queue at index 1, up to the
+ * length at index 2, in the same way as dispatch_timers.
+ */
+static int dispatch_ready(lua_State *L)
+{
+    int count = lua_tointeger(L, 2);
+    int *pos = batch_dispatch_pos;
+
+    while (*pos < count)
+    {
+        lua_rawgeti(L, 1, ++*pos);
+        lua_rawgeti(L, 1, ++*pos);
+        int nargs = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+
+        luaL_checkstack(L, nargs, "too many arguments");
+        for (int i = 0; i < nargs; i++)
+            lua_rawgeti(L, 1, ++*pos);
+
+        resume_waiter(L, nargs);
+    }
+
+    return 0;
+}
+
+/*
+ * Calls fn(batch, count, table) until it reaches the end of the batch,
+ * restarting it after each error.
+ */
+static void run_batch(color_ostream &out, lua_State *L, lua_CFunction fn,
+                      int batch, int count, int table)
+{
+    int pos = 0;
+    while (pos < count)
+    {
+        lua_pushcfunction(L, fn);
+        lua_pushvalue(L, batch);
+        lua_pushinteger(L, count);
+        lua_pushvalue(L, table);
+
+        int start = pos;
+        int *old_pos = batch_dispatch_pos;
+        batch_dispatch_pos = &pos;
+        bool ok = Lua::SafeCall(out, L, 3, 0);
+        batch_dispatch_pos = old_pos;
+
+        if (!ok && pos == start)
+            break;
+    }
+}
+
+static void run_timers(color_ostream &out, lua_State *L,
+                       TimerHeap &timers, int table, int bound)
+{
+    if (timers.empty() || timers.top().due > bound)
+        return;
+
+    // Collect all due timers, rescheduling the repeating ones
+    lua_newtable(L);
+    int batch = lua_gettop(L);
+    int count = 0;
+
+    while (!timers.empty() && timers.top().due <= bound)
+    {
+        TimerEntry entry = timers.top();
+        timers.pop();
+
+        if (entry.period > 0)
+        {
+            entry.due = std::max(entry.due + entry.period, bound + 1);
+            timers.push(entry);
+
+            lua_pushinteger(L, -entry.id-1);
         }
+        else
+            lua_pushinteger(L, entry.id);
+
+        lua_rawseti(L, batch, ++count);
     }
+
+    // Run them all in one protected call, unless one of them fails
+    ProfileScope scope("timeout");
+    run_batch(out, L, dispatch_timers, batch, count, table);
+
+    lua_settop(L, batch-1);
 }
 
 void DFHack::Lua::Core::onUpdate(color_ostream &out)
 {
     using df::global::world;
 
-    if (frame_timers.empty() && tick_timers.empty())
-        return;
+    if (!frame_timers.empty() || !tick_timers.empty())
+    {
+        Lua::StackUnwinder frame(State);
+        lua_rawgetp(State, LUA_REGISTRYINDEX, &DFHACK_TIMEOUTS_TOKEN);
+
+        run_timers(out, State, frame_timers, frame[1], ++frame_idx);
+
+        if (world)
+            run_timers(out, State, tick_timers, frame[1], world->frame_counter);
+    }
+
+    if (async_ready_len > 0)
+    {
+        Lua::StackUnwinder frame(State);
+        lua_rawgetp(State, LUA_REGISTRYINDEX, &DFHACK_ASYNC_READY_TOKEN);
+        int count = async_ready_len;
+
+        // Coroutines that become ready while running go to the next frame
+        lua_newtable(State);
+        lua_rawsetp(State, LUA_REGISTRYINDEX, &DFHACK_ASYNC_READY_TOKEN);
+        async_ready_len = 0;
+
+        ProfileScope scope("async");
+        run_batch(out, State, dispatch_ready, frame[1], count, frame[1]);
+    }
+
+    RunLuaWorkerEvents(out, State);
+
+    step_gc(State);
+}
+
+static int DFHACK_RPC_METHODS_TOKEN = 0;
+
+static int dfhack_rpc_register(lua_State *L)
+{
+    luaL_checkstring(L, 1);
+    if (!lua_isnil(L, 2))
+        luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_settop(L, 2);
+
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &DFHACK_RPC_METHODS_TOKEN);
+    lua_insert(L, 1);
+    lua_rawset(L, 1);
+    return 0;
+}
+
+static const luaL_Reg dfhack_rpc_funcs[] = {
+    { "register", dfhack_rpc_register },
+    { "encode", dfhack_rpc_encode },
+    { "decode", dfhack_rpc_decode },
+    { NULL, NULL }
+};
+
+struct rpc_call_info {
+    const std::string *args;
+    std::string error;
+    bool bad_args;
+};
 
+/*
+ * Decodes the arguments and calls the method. Runs as a whole inside
+ * SafeCall, so that errors raised while building the argument tables
+ * cannot escape to the caller.
+ */
+static int dfhack_rpc_call_method(lua_State *L)
+{
+    auto info = (rpc_call_info*)lua_touserdata(L, 2);
+    lua_settop(L, 1);
+
+    if (info->args->empty())
+        lua_pushnil(L);
+    else if (!Lua::DecodeValue(L, info->args->data(), info->args->size(), &info->error))
+    {
+        info->bad_args = true;
+        return 0;
+    }
+
+    lua_call(L, 1, 1);
+    return 1;
+}
+
+command_result DFHack::Lua::Core::CallRPCMethod(color_ostream &out, const std::string &name,
+                                                const std::string &args, std::string *result)
+{
     Lua::StackUnwinder frame(State);
-    lua_rawgetp(State, LUA_REGISTRYINDEX, &DFHACK_TIMEOUTS_TOKEN);
 
-    run_timers(out, State, frame_timers, frame[1], ++frame_idx);
+    lua_rawgetp(State, LUA_REGISTRYINDEX, &DFHACK_RPC_METHODS_TOKEN);
+    Lua::Push(State, name);
+    lua_rawget(State, -2);
 
-    if (world)
-        run_timers(out, State, tick_timers, frame[1], world->frame_counter);
+    if (!lua_isfunction(State, -1))
+    {
+        out.printerr("No such lua RPC method: %s\n", name.c_str());
+        return CR_NOT_FOUND;
+    }
+
+    rpc_call_info info;
+    info.args = &args;
+    info.bad_args = false;
+
+    lua_pushcfunction(State, dfhack_rpc_call_method);
+    lua_insert(State, -2);
+    lua_pushlightuserdata(State, &info);
+
+    if (!Lua::SafeCall(out, State, 2, 1))
+        return CR_FAILURE;
+
+    if (info.bad_args)
+    {
+        out.printerr("In lua RPC method %s: invalid arguments: %s\n",
+                     name.c_str(), info.error.c_str());
+        return CR_WRONG_USAGE;
+    }
+
+    std::string error;
+
+    if (!Lua::EncodeValue(State, -1, result, &error))
+    {
+        out.printerr("In lua RPC method %s: invalid result: %s\n",
+                     name.c_str(), error.c_str());
+        return CR_FAILURE;
+    }
+
+    return CR_OK;
 }
 
 void DFHack::Lua::Core::Init(color_ostream &out)
@@ -1857,6 +3268,29 @@ static void Lua::Core::InitCoreContext()
     lua_pushcfunction(State, dfhack_timeout_active);
     lua_setfield(State, -2, "timeout_active");
 
+    lua_newtable(State);
+    lua_rawsetp(State, LUA_REGISTRYINDEX, &DFHACK_ASYNC_READY_TOKEN);
+    lua_newtable(State);
+    lua_rawsetp(State, LUA_REGISTRYINDEX, &DFHACK_STATE_WAITERS_TOKEN);
+    lua_newtable(State);
+    lua_rawsetp(State, LUA_REGISTRYINDEX, &DFHACK_EVENT_WAITERS_TOKEN);
+    luaL_setfuncs(State, dfhack_async_funcs, 0);
+
+    lua_newtable(State);
+    lua_rawsetp(State, LUA_REGISTRYINDEX, &DFHACK_RPC_METHODS_TOKEN);
+
+    lua_newtable(State);
+    luaL_setfuncs(State, dfhack_rpc_funcs, 0);
+    lua_setfield(State, -2, "rpc");
+
+    lua_getfield(State, -1, "internal");
+    luaL_setfuncs(State, dfhack_internal_core_funcs, 0);
+    lua_pop(State, 1);
+
+    OpenLuaWorkers(State);
+
+    init_gc(State);
+
     lua_pop(State, 1);
 }
 
@@ -1869,4 +3303,6 @@ void DFHack::Lua::Core::Reset(color_ostream &out, const char *where)
         out.printerr("Common lua context stack top left at %d after %s.\n", top, where);
         lua_settop(State, 0);
     }
+
+    LuaWrapper::ClearObjectCache(State);
 }
@@ -593,6 +593,127 @@ static int meta_struct_index(lua_State *state)
     return 1;
 }
 
+/*
+ * Fast path for reading primitive fields of structures. When the
+ * metatable is built, every numeric or boolean field is encoded as
+ * offset*16+kind in a separate raw table, which is consulted before
+ * the generic field lookup and avoids the virtual lua_read call.
+ */
+
+#define UPVAL_FAST_FIELDS lua_upvalueindex(4)
+
+enum FastFieldKind {
+    FAST_INT8 = 1, FAST_UINT8, FAST_INT16, FAST_UINT16,
+    FAST_INT32, FAST_UINT32, FAST_INT64, FAST_UINT64,
+    FAST_BOOL, FAST_FLOAT, FAST_DOUBLE
+};
+
+static bool fast_field_reads = true;
+
+void LuaWrapper::SetFastFieldReads(bool enable)
+{
+    fast_field_reads = enable;
+}
+
+static int get_fast_field_kind(type_identity *type)
+{
+    using df::identity_traits;
+
+    if (type->type() == IDTYPE_ENUM)
+        type = ((enum_identity*)type)->getBaseType();
+
+    if (type == identity_traits<int8_t>::get()) return FAST_INT8;
+    if (type == identity_traits<uint8_t>::get()) return FAST_UINT8;
+    if (type == identity_traits<int16_t>::get()) return FAST_INT16;
+    if (type == identity_traits<uint16_t>::get()) return FAST_UINT16;
+    if (type == identity_traits<int32_t>::get()) return FAST_INT32;
+    if (type == identity_traits<uint32_t>::get()) return FAST_UINT32;
+    if (type == identity_traits<int64_t>::get()) return FAST_INT64;
+    if (type == identity_traits<uint64_t>::get()) return FAST_UINT64;
+    if (type == identity_traits<bool>::get()) return FAST_BOOL;
+    if (type == identity_traits<float>::get()) return FAST_FLOAT;
+    if (type == identity_traits<double>::get()) return FAST_DOUBLE;
+    return 0;
+}
+
+static void read_fast_field(lua_State *state, uint8_t *ptr, int kind)
+{
+    switch (kind)
+    {
+    case FAST_INT8: lua_pushinteger(state, *(int8_t*)ptr); return;
+    case FAST_UINT8: lua_pushinteger(state, *(uint8_t*)ptr); return;
+    case FAST_INT16: lua_pushinteger(state, *(int16_t*)ptr); return;
+    case FAST_UINT16: lua_pushinteger(state, *(uint16_t*)ptr); return;
+    case FAST_INT32: lua_pushinteger(state, *(int32_t*)ptr); return;
+    case FAST_UINT32: lua_pushnumber(state, *(uint32_t*)ptr); return;
+    case FAST_INT64: lua_pushnumber(state, double(*(int64_t*)ptr)); return;
+    case FAST_UINT64: lua_pushnumber(state, double(*(uint64_t*)ptr)); return;
+    case FAST_BOOL: lua_pushboolean(state, *(bool*)ptr); return;
+    case FAST_FLOAT: lua_pushnumber(state, *(float*)ptr); return;
+    case FAST_DOUBLE: lua_pushnumber(state, *(double*)ptr); return;
+    default: lua_pushnil(state);
+    }
+}
+
+/**
+ * Build the fast field table from the field table on the stack.
+ */
+static void MakeFastFieldTable(lua_State *state, int ftable_idx)
+{
+    lua_newtable(state);
+    int fast = lua_gettop(state);
+
+    lua_pushnil(state);
+    while (lua_next(state, ftable_idx))
+    {
+        if (lua_type(state, -2) == LUA_TSTRING && lua_islightuserdata(state, -1))
+        {
+            auto field = (struct_field_info*)lua_touserdata(state, -1);
+            int kind = 0;
+            if (field && field->mode == struct_field_info::PRIMITIVE && field->type)
+                kind = get_fast_field_kind(field->type);
+
+            if (kind)
+            {
+                lua_pushvalue(state, -2);
+                lua_pushnumber(state, double(field->offset)*16 + kind);
+                lua_rawset(state, fast);
+            }
+        }
+
+        lua_pop(state, 1);
+    }
+}
+
+/**
+ * Metamethod: __index for structures, with the primitive field fast path.
+ */
+static int meta_struct_fast_index(lua_State *state)
+{
+    uint8_t *ptr = get_object_addr(state, 1, 2, "read");
+
+    if (fast_field_reads)
+    {
+        lua_pushvalue(state, 2);
+        lua_rawget(state, UPVAL_FAST_FIELDS);
+
+        if (lua_type(state, -1) == LUA_TNUMBER)
+        {
+            size_t code = (size_t)lua_tonumber(state, -1);
+            read_fast_field(state, ptr + (code >> 4), int(code & 15));
+            return 1;
+        }
+
+        lua_pop(state, 1);
+    }
+
+    auto field = (struct_field_info*)find_field(state, 2, "read");
+    if (!field)
+        return 1;
+    read_field(state, field, ptr + field->offset);
+    return 1;
+}
+
 /**
  * Method: _field for structures.
  */
@@ -1000,6 +1121,241 @@ static int meta_bitfield_next(lua_State *state)
     return 2;
 }
 
+/*
+ * Bulk extraction of fields from containers of structures.
+ */
+
+struct extract_path {
+    std::vector<size_t> derefs; // offsets of pointers to follow, in order
+    size_t offset;
+    const struct_field_info *field;
+    bitfield_identity *bits;
+    int bit_idx;
+};
+
+static const struct_field_info *find_struct_field(struct_identity *pstruct, const char *name)
+{
+    // Same resolution order as IndexFields: parent fields shadow the child ones
+    if (pstruct->getParent())
+    {
+        auto field = find_struct_field(pstruct->getParent(), name);
+        if (field)
+            return field;
+    }
+
+    auto fields = pstruct->getFields();
+    if (!fields)
+        return NULL;
+
+    for (int i = 0; fields[i].mode != struct_field_info::END; ++i)
+    {
+        if (fields[i].mode == struct_field_info::OBJ_METHOD ||
+            fields[i].mode == struct_field_info::CLASS_METHOD)
+            continue;
+        if (strcmp(fields[i].name, name) == 0)
+            return &fields[i];
+    }
+
+    return NULL;
+}
+
+static bool is_struct_type(type_identity *id)
+{
+    return id && (id->type() == IDTYPE_STRUCT || id->type() == IDTYPE_CLASS);
+}
+
+/**
+ * Resolve a dotted field path like 'pos.x' or 'flags1.dead' into offsets.
+ */
+static void resolve_extract_path(lua_State *state, extract_path *path,
+                                 struct_identity *root, const std::string &spec)
+{
+    path->offset = 0;
+    path->field = NULL;
+    path->bits = NULL;
+    path->bit_idx = -1;
+
+    type_identity *cur = root;
+    size_t start = 0;
+
+    for (;;)
+    {
+        size_t end = spec.find('.', start);
+        std::string name = spec.substr(start, end == std::string::npos ? end : end - start);
+        bool last = (end == std::string::npos);
+
+        if (name.empty())
+            luaL_error(state, "Invalid field path in df.extract(): '%s'", spec.c_str());
+
+        if (cur->type() == IDTYPE_BITFIELD)
+        {
+            auto bits = (bitfield_identity*)cur;
+            auto items = bits->getBits();
+
+            for (int i = 0; i < bits->getNumBits(); i++)
+            {
+                if (items[i].name && name == items[i].name)
+                {
+                    path->bits = bits;
+                    path->bit_idx = i;
+                    break;
+                }
+            }
+
+            if (!path->bits || !last)
+                luaL_error(state, "Invalid bitfield path in df.extract(): '%s'", spec.c_str());
+            return;
+        }
+
+        if (!is_struct_type(cur))
+            luaL_error(state, "Cannot index '%s' in df.extract(): '%s'",
+                       name.c_str(), spec.c_str());
+
+        auto field = find_struct_field((struct_identity*)cur, name.c_str());
+        if (!field)
+            luaL_error(state, "Unknown field '%s' in df.extract(): '%s'",
+                       name.c_str(), spec.c_str());
+
+        if (last)
+        {
+            path->offset += field->offset;
+            path->field = field;
+            return;
+        }
+
+        switch (field->mode)
+        {
+        case struct_field_info::PRIMITIVE:
+        case struct_field_info::SUBSTRUCT:
+            if (!is_struct_type(field->type) && field->type->type() != IDTYPE_BITFIELD)
+                break;
+            path->offset += field->offset;
+            cur = field->type;
+            start = end+1;
+            continue;
+
+        case struct_field_info::POINTER:
+            if (!is_struct_type(field->type))
+                break;
+            path->derefs.push_back(path->offset + field->offset);
+            path->offset = 0;
+            cur = field->type;
+            start = end+1;
+            continue;
+
+        default:
+            break;
+        }
+
+        luaL_error(state, "Cannot descend into field '%s' in df.extract(): '%s'",
+                   name.c_str(), spec.c_str());
+    }
+}
+
+static void extract_value(lua_State *state, const extract_path &path, uint8_t *ptr)
+{
+    for (size_t i = 0; i < path.derefs.size(); i++)
+    {
+        ptr = *(uint8_t**)(ptr + path.derefs[i]);
+        if (!ptr)
+        {
+            lua_pushnil(state);
+            return;
+        }
+    }
+
+    ptr += path.offset;
+
+    if (path.bits)
+        read_bitfield(state, ptr, path.bits, path.bit_idx);
+    else
+        read_field(state, path.field, ptr);
+}
+
+/**
+ * Method: df.extract(container, {path,...})
+ *
+ * Returns one array per path, holding the value of that
+ * field for every item of the container, in container order.
+ */
+int LuaWrapper::bulk_extract(lua_State *state)
+{
+    if (lua_gettop(state) != 2 || !lua_istable(state, 2))
+        luaL_error(state, "Usage: df.extract(container, {field,...})");
+
+    auto id = get_object_identity(state, 1, "df.extract()", false, true);
+    int meta = lua_gettop(state);
+
+    if (!id->isContainer())
+        luaL_error(state, "Container expected in df.extract()");
+
+    auto ctype = (container_identity*)id;
+    uint8_t *cptr = (uint8_t*)get_object_ref(state, 1);
+
+    type_identity *item = ctype->getItemType();
+    int count = -1;
+
+    lua_getfield(state, meta, "_field_identity");
+    if (lua_islightuserdata(state, -1))
+        item = (type_identity*)lua_touserdata(state, -1);
+    lua_getfield(state, meta, "_count");
+    if (lua_isnumber(state, -1))
+        count = lua_tointeger(state, -1);
+    lua_pop(state, 3);
+
+    if (count < 0)
+        count = ctype->getItemCount(cptr);
+
+    // Items are either structures, or pointers to structures
+    bool deref = (id->type() == IDTYPE_PTR_CONTAINER || id->type() == IDTYPE_STL_PTR_VECTOR);
+    type_identity *target = item;
+
+    if (!deref && item && item->type() == IDTYPE_POINTER)
+    {
+        deref = true;
+        target = ((df::pointer_identity*)item)->getTarget();
+    }
+
+    if (!is_struct_type(target))
+        luaL_error(state, "Container of structures expected in df.extract()");
+
+    // Resolve all paths once
+    int npaths = lua_rawlen(state, 2);
+    std::vector<extract_path> paths(npaths);
+
+    for (int i = 0; i < npaths; i++)
+    {
+        lua_rawgeti(state, 2, i+1);
+        if (!lua_isstring(state, -1))
+            luaL_error(state, "Field path string expected in df.extract()");
+        resolve_extract_path(state, &paths[i], (struct_identity*)target, lua_tostring(state, -1));
+        lua_pop(state, 1);
+    }
+
+    luaL_checkstack(state, npaths+2, "too many fields in df.extract()");
+
+    int base = lua_gettop(state);
+    for (int i = 0; i < npaths; i++)
+        lua_createtable(state, count, 0);
+
+    for (int j = 0; j < count; j++)
+    {
+        uint8_t *pitem = (uint8_t*)ctype->getItemPointer(item, cptr, j);
+        if (deref)
+            pitem = *(uint8_t**)pitem;
+        if (!pitem)
+            continue;
+
+        for (int i = 0; i < npaths; i++)
+        {
+            extract_value(state, paths[i], pitem);
+            lua_rawseti(state, base+1+i, j+1);
+        }
+    }
+
+    return npaths;
+}
+
 /**
  * Metamethod: __index for df.global
  */
@@ -1236,7 +1592,19 @@ static void MakeFieldMetatable(lua_State *state, struct_identity *pstruct,
     lua_setfield(state, base+1, "_index_table");
 
     // Add the indexing metamethods
-    SetStructMethod(state, base+1, base+2, reader, "__index");
+    if (reader == meta_struct_index)
+    {
+        // Same upvalues as PushStructMethod, plus the fast field table
+        lua_rawgetp(state, LUA_REGISTRYINDEX, &DFHACK_TYPETABLE_TOKEN);
+        lua_pushvalue(state, base+1);
+        lua_pushvalue(state, base+2);
+        MakeFastFieldTable(state, base+2);
+        lua_pushcclosure(state, meta_struct_fast_index, 4);
+        lua_setfield(state, base+1, "__index");
+    }
+    else
+        SetStructMethod(state, base+1, base+2, reader, "__index");
+
     SetStructMethod(state, base+1, base+2, writer, "__newindex");
 
     // returns: [metatable readfields writefields];
@@ -0,0 +1,509 @@
+/*
+https://github.com/peterix/dfhack
+Copyright (c) 2009-2012 Petr Mrázek (peterix@gmail.com)
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any
+damages arising from the use of this software.
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must
+not claim that you wrote the original software. If you use this
+software in a product, an acknowledgment in the product documentation
+would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software.
+
+3. This notice may not be removed or altered from any source
+distribution.
+*/
+
+
+#include "Internal.h"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <fstream>
+#include <sstream>
+#include <stdlib.h>
+
+#include "Core.h"
+#include "ColorText.h"
+#include "tinythread.h"
+
+#include "DataDefs.h"
+#include "df/coord.h"
+#include "df/coord2d.h"
+
+#include "LuaTools.h"
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+using namespace DFHack;
+using namespace tthread;
+
+/*
+ * Worker lua states: isolated interpreters without any access to DF,
+ * running on a small pool of threads. Arguments, messages and results
+ * are passed as copies in the Lua::EncodeValue format, and delivered
+ * to the core context from Lua::Core::onUpdate.
+ */
+
+namespace {
+    struct WorkerJob {
+        int id;
+        std::string source;
+        std::string chunkname;
+        std::string args;
+        bool cancel; // guarded by worker_lock
+    };
+
+    enum MessageKind {
+        MSG_POST,
+        MSG_PRINT,
+        MSG_DONE,
+        MSG_ERROR
+    };
+
+    struct WorkerMessage {
+        int id;
+        MessageKind kind;
+        std::string data;
+    };
+}
+
+static mutex worker_lock;
+static condition_variable worker_cond;
+static std::deque<WorkerJob*> job_queue;
+static std::deque<WorkerMessage> outbox;
+static std::vector<thread*> worker_threads;
+
+// Only accessed from the core context
+static std::map<int, WorkerJob*> active_jobs;
+static int next_worker_id = 1;
+
+static int WORKER_JOB_TOKEN = 0;
+static int WORKER_MESSAGE_EVENT = 0;
+static int WORKER_FINISH_EVENT = 0;
+
+static void post_message(int id, MessageKind kind, const std::string &data)
+{
+    WorkerMessage msg;
+    msg.id = id;
+    msg.kind = kind;
+    msg.data = data;
+
+    lock_guard<mutex> guard(worker_lock);
+    outbox.push_back(msg);
+}
+
+/*
+ * Functions available inside the worker state.
+ */
+
+static WorkerJob *get_job(lua_State *L)
+{
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &WORKER_JOB_TOKEN);
+    auto job = (WorkerJob*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return job;
+}
+
+static int worker_post(lua_State *L)
+{
+    std::string data, error;
+    lua_settop(L, 1);
+    if (!Lua::EncodeValue(L, 1, &data, &error))
+        luaL_error(L, "%s", error.c_str());
+
+    post_message(get_job(L)->id, MSG_POST, data);
+    return 0;
+}
+
+static int worker_print(lua_State *L)
+{
+    int n = lua_gettop(L);
+    std::string line;
+
+    lua_getglobal(L, "tostring");
+    for (int i = 1; i <= n; i++)
+    {
+        lua_pushvalue(L, -1);
+        lua_pushvalue(L, i);
+        lua_call(L, 1, 1);
+
+        const char *s = lua_tostring(L, -1);
+        if (!s)
+            luaL_error(L, "'tostring' must return a string to 'print'");
+
+        if (i > 1)
+            line += '\t';
+        line += s;
+        lua_pop(L, 1);
+    }
+
+    post_message(get_job(L)->id, MSG_PRINT, line + "\n");
+    return 0;
+}
+
+static bool is_cancelled(lua_State *L)
+{
+    WorkerJob *job = get_job(L);
+
+    lock_guard<mutex> guard(worker_lock);
+    return job->cancel;
+}
+
+static int worker_cancelled(lua_State *L)
+{
+    lua_pushboolean(L, is_cancelled(L));
+    return 1;
+}
+
+static const luaL_Reg worker_funcs[] = {
+    { "post", worker_post },
+    { "print", worker_print },
+    { "cancelled", worker_cancelled },
+    { NULL, NULL }
+};
+
+static const luaL_Reg worker_libs[] = {
+    { "_G", luaopen_base },
+    { LUA_COLIBNAME, luaopen_coroutine },
+    { LUA_TABLIBNAME, luaopen_table },
+    { LUA_STRLIBNAME, luaopen_string },
+    { LUA_BITLIBNAME, luaopen_bit32 },
+    { LUA_MATHLIBNAME, luaopen_math },
+    { NULL, NULL }
+};
+
+static void worker_hook(lua_State *L, lua_Debug *)
+{
+    if (is_cancelled(L))
+        luaL_error(L, "cancelled");
+}
+
+static int worker_traceback(lua_State *L)
+{
+    const char *msg = lua_tostring(L, 1);
+    luaL_traceback(L, L, msg ? msg : "(error object is not a string)", 1);
+    return 1;
+}
+
+static int worker_main(lua_State *L)
+{
+    auto job = get_job(L);
+
+    for (const luaL_Reg *lib = worker_libs; lib->func; lib++)
+    {
+        luaL_requiref(L, lib->name, lib->func, 1);
+        lua_pop(L, 1);
+    }
+
+    lua_pushglobaltable(L);
+    luaL_setfuncs(L, worker_funcs, 0);
+    lua_pop(L, 1);
+
+    lua_pushcfunction(L, worker_traceback);
+    int msgh = lua_gettop(L);
+
+    if (luaL_loadbuffer(L, job->source.data(), job->source.size(), job->chunkname.c_str()) != LUA_OK)
+        return lua_error(L);
+
+    std::string error;
+    if (!Lua::DecodeValue(L, job->args.data(), job->args.size(), &error))
+        luaL_error(L, "%s", error.c_str());
+
+    int args = lua_gettop(L);
+    int nargs = lua_rawlen(L, args);
+    luaL_checkstack(L, nargs+LUA_MINSTACK, "too many arguments");
+    for (int i = 1; i <= nargs; i++)
+        lua_rawgeti(L, args, i);
+    lua_remove(L, args);
+
+    lua_sethook(L, worker_hook, LUA_MASKCOUNT, 10000);
+    if (lua_pcall(L, nargs, LUA_MULTRET, msgh) != LUA_OK)
+        return lua_error(L);
+    lua_sethook(L, NULL, 0, 0);
+
+    // Pack the results into a table
+    int nres = lua_gettop(L) - msgh;
+    lua_createtable(L, nres, 0);
+    lua_insert(L, msgh+1);
+    for (int i = nres; i >= 1; i--)
+        lua_rawseti(L, msgh+1, i);
+
+    std::string data;
+    if (!Lua::EncodeValue(L, msgh+1, &data, &error))
+        luaL_error(L, "invalid result: %s", error.c_str());
+
+    lua_pushlstring(L, data.data(), data.size());
+    return 1;
+}
+
+static void run_job(WorkerJob *job)
+{
+    lua_State *L = luaL_newstate();
+    if (!L)
+    {
+        post_message(job->id, MSG_ERROR, "could not create lua state");
+        return;
+    }
+
+    lua_pushlightuserdata(L, job);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &WORKER_JOB_TOKEN);
+
+    int id = job->id;
+    MessageKind kind = MSG_DONE;
+    std::string data;
+
+    lua_pushcfunction(L, worker_main);
+    if (lua_pcall(L, 0, 1, 0) != LUA_OK)
+    {
+        const char *msg = lua_tostring(L, -1);
+        kind = MSG_ERROR;
+        data = msg ? msg : "unknown error";
+    }
+    else
+    {
+        size_t size;
+        const char *str = lua_tolstring(L, -1, &size);
+        data.assign(str, size);
+    }
+
+    // The main thread deletes the job once it sees the final message,
+    // so the state must be fully closed (finalizers included) before
+    // posting it; the cancel hook would otherwise touch a freed job.
+    lua_sethook(L, NULL, 0, 0);
+    lua_close(L);
+
+    post_message(id, kind, data);
+}
+
+static void workerFn(void *)
+{
+    for (;;)
+    {
+        WorkerJob *job;
+
+        {
+            lock_guard<mutex> guard(worker_lock);
+
+            while (job_queue.empty())
+                worker_cond.wait(worker_lock);
+
+            job = job_queue.front();
+            job_queue.pop_front();
+        }
+
+        run_job(job);
+    }
+}
+
+static void start_workers()
+{
+    if (!worker_threads.empty())
+        return;
+
+    const char *val = getenv("DFHACK_LUA_WORKERS");
+    int count = val ? atoi(val) : 0;
+
+    if (count <= 0)
+        count = 2;
+    else if (count > 16)
+        count = 16;
+
+    for (int i = 0; i < count; i++)
+        worker_threads.push_back(new thread(workerFn, NULL));
+}
+
+/*
+ * Core context API: dfhack.worker
+ */
+
+static int start_job(lua_State *L, const std::string &source, const std::string &chunkname)
+{
+    int n = lua_gettop(L);
+    lua_createtable(L, n-1, 0);
+    for (int i = 2; i <= n; i++)
+    {
+        lua_pushvalue(L, i);
+        lua_rawseti(L, -2, i-1);
+    }
+
+    std::string args, error;
+    if (!Lua::EncodeValue(L, -1, &args, &error))
+        luaL_error(L, "invalid worker argument: %s", error.c_str());
+
+    auto job = new WorkerJob();
+    job->id = next_worker_id++;
+    job->source = source;
+    job->chunkname = chunkname;
+    job->args = args;
+    job->cancel = false;
+
+    active_jobs[job->id] = job;
+    start_workers();
+
+    {
+        lock_guard<mutex> guard(worker_lock);
+        job_queue.push_back(job);
+    }
+    worker_cond.notify_one();
+
+    lua_pushinteger(L, job->id);
+    return 1;
+}
+
+static int dfhack_worker_start(lua_State *L)
+{
+    size_t size;
+    const char *source = luaL_checklstring(L, 1, &size);
+    return start_job(L, std::string(source, size), "=(worker)");
+}
+
+static int dfhack_worker_startFile(lua_State *L)
+{
+    std::string path = luaL_checkstring(L, 1);
+
+    std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+    if (!in)
+        luaL_error(L, "cannot open %s", path.c_str());
+
+    std::stringstream source;
+    source << in.rdbuf();
+    return start_job(L, source.str(), "@" + path);
+}
+
+static int dfhack_worker_cancel(lua_State *L)
+{
+    int id = luaL_checkint(L, 1);
+    auto it = active_jobs.find(id);
+    if (it == active_jobs.end())
+        return 0;
+
+    lock_guard<mutex> guard(worker_lock);
+    it->second->cancel = true;
+
+    // Jobs that did not start yet are finished right away
+    for (auto qit = job_queue.begin(); qit != job_queue.end(); ++qit)
+    {
+        if (*qit != it->second)
+            continue;
+
+        job_queue.erase(qit);
+
+        WorkerMessage msg;
+        msg.id = id;
+        msg.kind = MSG_ERROR;
+        msg.data = "cancelled";
+        outbox.push_back(msg);
+        break;
+    }
+
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+static int dfhack_worker_isActive(lua_State *L)
+{
+    lua_pushboolean(L, active_jobs.count(luaL_checkint(L, 1)) > 0);
+    return 1;
+}
+
+static const luaL_Reg dfhack_worker_funcs[] = {
+    { "start", dfhack_worker_start },
+    { "startFile", dfhack_worker_startFile },
+    { "cancel", dfhack_worker_cancel },
+    { "isActive", dfhack_worker_isActive },
+    { NULL, NULL }
+};
+
+/**
+ * Adds the worker table to the dfhack table on the top of the stack.
+ */
+void OpenLuaWorkers(lua_State *state)
+{
+    lua_newtable(state);
+    luaL_setfuncs(state, dfhack_worker_funcs, 0);
+
+    Lua::Event::Make(state, &WORKER_MESSAGE_EVENT);
+    lua_setfield(state, -2, "onMessage");
+    Lua::Event::Make(state, &WORKER_FINISH_EVENT);
+    lua_setfield(state, -2, "onFinish");
+
+    lua_setfield(state, -2, "worker");
+}
+
+/**
+ * Delivers the messages posted by workers since the last call.
+ */
+void RunLuaWorkerEvents(color_ostream &out, lua_State *state)
+{
+    if (active_jobs.empty())
+        return;
+
+    std::deque<WorkerMessage> messages;
+
+    {
+        lock_guard<mutex> guard(worker_lock);
+        messages.swap(outbox);
+    }
+
+    for (auto it = messages.begin(); it != messages.end(); ++it)
+    {
+        Lua::StackUnwinder frame(state);
+        std::string error;
+
+        switch (it->kind)
+        {
+        case MSG_PRINT:
+            out.print("%s", it->data.c_str());
+            break;
+
+        case MSG_POST:
+            lua_pushinteger(state, it->id);
+            if (Lua::DecodeValue(state, it->data.data(), it->data.size(), &error))
+                Lua::Event::Invoke(out, state, &WORKER_MESSAGE_EVENT, 2);
+            else
+                out.printerr("Invalid message from lua worker %d: %s\n", it->id, error.c_str());
+            break;
+
+        case MSG_DONE:
+        case MSG_ERROR:
+        {
+            auto job = active_jobs.find(it->id);
+            if (job != active_jobs.end())
+            {
+                delete job->second;
+                active_jobs.erase(job);
+            }
+
+            bool ok = (it->kind == MSG_DONE);
+
+            lua_pushinteger(state, it->id);
+            lua_pushboolean(state, ok);
+
+            if (!ok)
+                lua_pushstring(state, it->data.c_str());
+            else if (!Lua::DecodeValue(state, it->data.data(), it->data.size(), &error))
+            {
+                lua_pushboolean(state, false);
+                lua_replace(state, -2);
+                lua_pushstring(state, error.c_str());
+            }
+
+            Lua::Event::Invoke(out, state, &WORKER_FINISH_EVENT, 3);
+            break;
+        }
+        }
+    }
+}
@@ -185,6 +185,109 @@ void *LuaWrapper::get_object_ref(lua_State *state, int val_index)
     return ref->ptr;
 }
 
+/*
+ * Object ref cache.
+ */
+
+// Number of states with the cache enabled; lets pushes skip the lookup
+static int object_cache_users = 0;
+
+ObjectCacheStats *LuaWrapper::GetObjectCacheStats(lua_State *state)
+{
+    // The userdata is anchored in the registry, so the pointer stays valid
+    lua_rawgetp(state, LUA_REGISTRYINDEX, &DFHACK_OBJECT_CACHE_TOKEN);
+    auto cache = (ObjectCacheStats*)lua_touserdata(state, -1);
+    lua_pop(state, 1);
+    return cache;
+}
+
+void LuaWrapper::SetObjectCacheEnabled(lua_State *state, bool enable)
+{
+    auto cache = GetObjectCacheStats(state);
+    if (!cache)
+        return;
+
+    if (!enable)
+        ClearObjectCache(state);
+
+    if (enable != cache->enabled)
+        object_cache_users += enable ? 1 : -1;
+    cache->enabled = enable;
+}
+
+void LuaWrapper::ClearObjectCache(lua_State *state)
+{
+    lua_rawgetp(state, LUA_REGISTRYINDEX, &DFHACK_OBJECT_CACHE_TOKEN);
+    if (lua_isuserdata(state, -1))
+    {
+        lua_newtable(state);
+        lua_setuservalue(state, -2);
+    }
+    lua_pop(state, 1);
+}
+
+static bool lookup_cached_ref(lua_State *state, void *ptr)
+{
+    // stack: [metatable]
+    int meta = lua_gettop(state);
+
+    lua_rawgetp(state, LUA_REGISTRYINDEX, &DFHACK_OBJECT_CACHE_TOKEN);
+    lua_getuservalue(state, -1);
+    lua_pushvalue(state, meta);
+    lua_rawget(state, -2);
+
+    if (lua_istable(state, -1))
+    {
+        lua_rawgetp(state, -1, ptr);
+
+        if (lua_isuserdata(state, -1))
+        {
+            lua_replace(state, meta);
+            lua_settop(state, meta);
+            return true; // stack: [userdata]
+        }
+    }
+
+    lua_settop(state, meta);
+    return false;
+}
+
+static void save_cached_ref(lua_State *state, void *ptr)
+{
+    // stack: [metatable userdata]
+    int top = lua_gettop(state);
+
+    lua_rawgetp(state, LUA_REGISTRYINDEX, &DFHACK_OBJECT_CACHE_TOKEN);
+    lua_getuservalue(state, -1);
+    int map = lua_gettop(state);
+
+    lua_pushvalue(state, top-1);
+    lua_rawget(state, map);
+
+    if (!lua_istable(state, -1))
+    {
+        lua_pop(state, 1);
+
+        // A weak-valued table per type, so that unused refs are collected
+        lua_newtable(state);
+        lua_newtable(state);
+        lua_pushstring(state, "v");
+        lua_setfield(state, -2, "__mode");
+        lua_setmetatable(state, -2);
+
+        lua_pushvalue(state, top-1);
+        lua_pushvalue(state, -2);
+        lua_rawset(state, map);
+    }
+
+    lua_pushvalue(state, top);
+    lua_rawsetp(state, -2, ptr);
+
+    lua_settop(state, top);
+    lua_remove(state, top-1);
+    // stack: [userdata]
+}
+
 /**
  * Push the pointer using given identity.
  */
@@ -224,6 +327,26 @@ void LuaWrapper::push_object_internal(lua_State *state, type_identity *type, voi
     if (!LookupTypeInfo(state, in_method)) // type -> metatable?
         BuildTypeMetatable(state, type); // () -> metatable
 
+    if (object_cache_users > 0)
+    {
+        auto cache = GetObjectCacheStats(state);
+        if (cache && cache->enabled)
+        {
+            cache->pushes++;
+
+            if (lookup_cached_ref(state, ptr)) // metatable -> userdata?
+            {
+                cache->hits++;
+                return;
+            }
+
+            lua_dup(state);
+            push_object_ref(state, ptr); // metatable metatable -> metatable userdata
+            save_cached_ref(state, ptr); // metatable userdata -> userdata
+            return;
+        }
+    }
+
     push_object_ref(state, ptr); // metatable -> userdata
 }
 
@@ -1562,6 +1685,13 @@ static int DoAttach(lua_State *state)
     lua_newtable(state);
     lua_rawsetp(state, LUA_REGISTRYINDEX, &DFHACK_EMPTY_TABLE_TOKEN);
 
+    auto cache = (ObjectCacheStats*)lua_newuserdata(state, sizeof(ObjectCacheStats));
+    cache->enabled = false;
+    cache->pushes = cache->hits = 0;
+    lua_newtable(state);
+    lua_setuservalue(state, -2);
+    lua_rawsetp(state, LUA_REGISTRYINDEX, &DFHACK_OBJECT_CACHE_TOKEN);
+
     lua_pushcfunction(state, change_error);
     lua_setfield(state, LUA_REGISTRYINDEX, DFHACK_CHANGEERROR_NAME);
 
@@ -1639,6 +1769,9 @@ static int DoAttach(lua_State *state)
         lua_pushcfunction(state, meta_isnull);
         lua_setfield(state, -2, "isnull");
 
+        lua_pushcfunction(state, bulk_extract);
+        lua_setfield(state, -2, "extract");
+
         freeze_table(state, true, "df");
 
         // pairstable dftable dfmeta
@@ -1684,4 +1817,5 @@ namespace DFHack { namespace LuaWrapper {
     LuaToken DFHACK_ENUM_TABLE_TOKEN;
     LuaToken DFHACK_PTR_IDTABLE_TOKEN;
     LuaToken DFHACK_EMPTY_TABLE_TOKEN;
+    LuaToken DFHACK_OBJECT_CACHE_TOKEN;
 }}
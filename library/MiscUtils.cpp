@@ -167,6 +167,12 @@ uint64_t GetTimeMs64()
     return ret;
 }
 
+uint64_t GetTimeUs64()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
 
 #else // Windows
 uint64_t GetTimeMs64()
@@ -188,6 +194,19 @@ uint64_t GetTimeMs64()
 
     return ret;
 }
+
+uint64_t GetTimeUs64()
+{
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+
+    if (!freq.QuadPart)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+
+    return uint64_t(now.QuadPart / freq.QuadPart) * 1000000 +
+           uint64_t(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+}
 #endif
 
 /* Character decoding */
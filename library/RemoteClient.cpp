@@ -54,6 +54,9 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <sstream>
 
 #include <memory>
+#include <vector>
+
+#include <zlib.h>
 
 using namespace DFHack;
 
@@ -93,6 +96,7 @@ RemoteClient::RemoteClient(color_ostream *default_output)
     active = false;
     socket = new CActiveSocket();
     suspend_ready = false;
+    compress = false;
 
     if (!p_default_output)
     {
@@ -130,6 +134,51 @@ bool readFullBuffer(CSimpleSocket *socket, void *buf, int size)
     return true;
 }
 
+int remoteMessageWireSize(const RPCMessageHeader &header)
+{
+    int32_t size = header.size & ~RPCMessageHeader::COMPRESSED_FLAG;
+
+    if (size < 0 || size > RPCMessageHeader::MAX_MESSAGE_SIZE)
+        return -1;
+
+    return size;
+}
+
+bool unpackRemoteMessage(const RPCMessageHeader &header, std::vector<uint8_t> &buf,
+                         RPCTransportStats *stats)
+{
+    if (stats)
+        stats->wire_received += buf.size();
+
+    if (header.size & RPCMessageHeader::COMPRESSED_FLAG)
+    {
+        int32_t raw_size;
+
+        if (buf.size() < sizeof(raw_size))
+            return false;
+
+        memcpy(&raw_size, &buf[0], sizeof(raw_size));
+
+        if (raw_size < 0 || raw_size > RPCMessageHeader::MAX_MESSAGE_SIZE)
+            return false;
+
+        std::vector<uint8_t> raw(raw_size);
+        uLongf out_size = raw_size;
+
+        if (raw_size > 0 &&
+            (uncompress(&raw[0], &out_size, &buf[sizeof(raw_size)], buf.size() - sizeof(raw_size)) != Z_OK ||
+             out_size != uLongf(raw_size)))
+            return false;
+
+        buf.swap(raw);
+    }
+
+    if (stats)
+        stats->raw_received += buf.size();
+
+    return true;
+}
+
 int RemoteClient::GetDefaultPort()
 {
     const char *port = getenv("DFHACK_PORT");
@@ -163,9 +212,15 @@ bool RemoteClient::connect(int port)
 
     active = true;
 
+    // Compression can be turned off for debugging via DFHACK_RPC_COMPRESS=0
+    const char *want_compress = getenv("DFHACK_RPC_COMPRESS");
+    int version = RPCHandshakeHeader::CURRENT_VERSION;
+    if (want_compress && atoi(want_compress) == 0)
+        version = 1;
+
     RPCHandshakeHeader header;
     memcpy(header.magic, RPCHandshakeHeader::REQUEST_MAGIC, sizeof(header.magic));
-    header.version = 1;
+    header.version = version;
 
     if (socket->Send((uint8*)&header, sizeof(header)) != sizeof(header))
     {
@@ -182,13 +237,15 @@ bool RemoteClient::connect(int port)
     }
 
     if (memcmp(header.magic, RPCHandshakeHeader::RESPONSE_MAGIC, sizeof(header.magic)) ||
-        header.version != 1)
+        header.version < 1 || header.version > version)
     {
         default_output().printerr("Invalid handshake response.\n");
         socket->Close();
         return active = false;
     }
 
+    compress = (header.version >= 2);
+
     bind_call.name = "BindMethod";
     bind_call.p_client = this;
     bind_call.id = 0;
@@ -324,7 +381,8 @@ bool RemoteFunctionBase::bind(color_ostream &out, RemoteClient *client,
     return client->bind(out, this, name, proto);
 }
 
-bool sendRemoteMessage(CSimpleSocket *socket, int16_t id, const MessageLite *msg, bool size_ready)
+bool sendRemoteMessage(CSimpleSocket *socket, int16_t id, const MessageLite *msg, bool size_ready,
+                       bool compress, RPCTransportStats *stats)
 {
     int size = size_ready ? msg->GetCachedSize() : msg->ByteSize();
     int fullsz = size + sizeof(RPCMessageHeader);
@@ -339,6 +397,40 @@ bool sendRemoteMessage(CSimpleSocket *socket, int16_t id, const MessageLite *msg
     uint8_t *pend = msg->SerializeWithCachedSizesToArray(pstart);
     assert((pend - pstart) == size);
 
+    if (stats)
+        stats->raw_sent += size;
+
+    if (compress && size >= RPCMessageHeader::COMPRESS_THRESHOLD)
+    {
+        int32_t raw_size = size;
+        uLongf zsize = compressBound(size);
+        int zfullsz = sizeof(RPCMessageHeader) + sizeof(raw_size) + zsize;
+
+        uint8_t *zdata = new uint8_t[zfullsz];
+        uint8_t *zstart = zdata + sizeof(RPCMessageHeader);
+
+        // Only use the compressed form if it actually saves space
+        if (compress2(zstart + sizeof(raw_size), &zsize, pstart, size, Z_BEST_SPEED) == Z_OK &&
+            zsize + sizeof(raw_size) < uLongf(size))
+        {
+            memcpy(zstart, &raw_size, sizeof(raw_size));
+
+            size = sizeof(raw_size) + zsize;
+            fullsz = size + sizeof(RPCMessageHeader);
+
+            hdr = (RPCMessageHeader*)zdata;
+            hdr->id = id;
+            hdr->size = size | RPCMessageHeader::COMPRESSED_FLAG;
+
+            std::swap(data, zdata);
+        }
+
+        delete[] zdata;
+    }
+
+    if (stats)
+        stats->wire_sent += size;
+
     int got = socket->Send(data, fullsz);
     delete[] data;
     return (got == fullsz);
@@ -370,7 +462,7 @@ command_result RemoteFunctionBase::execute(color_ostream &out,
         return CR_LINK_FAILURE;
     }
 
-    if (!sendRemoteMessage(p_client->socket, id, input, true))
+    if (!sendRemoteMessage(p_client->socket, id, input, true, p_client->compress, &p_client->stats))
     {
         out.printerr("In call to %s::%s: I/O error in send.\n",
                      this->proto.c_str(), this->name.c_str());
@@ -397,38 +489,47 @@ command_result RemoteFunctionBase::execute(color_ostream &out,
         if ((DFHack::DFHackReplyCode)header.id == RPC_REPLY_FAIL)
             return header.size == CR_OK ? CR_FAILURE : command_result(header.size);
 
-        if (header.size < 0 || header.size > RPCMessageHeader::MAX_MESSAGE_SIZE)
+        int wire_size = remoteMessageWireSize(header);
+
+        if (wire_size < 0)
         {
             out.printerr("In call to %s::%s: invalid received size %d.\n",
                          this->proto.c_str(), this->name.c_str(), header.size);
             return CR_LINK_FAILURE;
         }
 
-        uint8_t *buf = new uint8_t[header.size];
+        std::vector<uint8_t> buf(wire_size);
 
-        if (!readFullBuffer(p_client->socket, buf, header.size))
+        if (wire_size > 0 && !readFullBuffer(p_client->socket, &buf[0], wire_size))
         {
             out.printerr("In call to %s::%s: I/O error in receive %d bytes of data.\n",
-                         this->proto.c_str(), this->name.c_str(), header.size);
+                         this->proto.c_str(), this->name.c_str(), wire_size);
             return CR_LINK_FAILURE;
         }
 
+        if (!unpackRemoteMessage(header, buf, &p_client->stats))
+        {
+            out.printerr("In call to %s::%s: could not decompress received data.\n",
+                         this->proto.c_str(), this->name.c_str());
+            return CR_LINK_FAILURE;
+        }
+
+        const uint8_t *data = buf.empty() ? NULL : &buf[0];
+
         switch (header.id) {
         case RPC_REPLY_RESULT:
-            if (!output->ParseFromArray(buf, header.size))
+            if (!output->ParseFromArray(data, buf.size()))
             {
                 out.printerr("In call to %s::%s: error parsing received result.\n",
                              this->proto.c_str(), this->name.c_str());
-                delete[] buf;
                 return CR_LINK_FAILURE;
             }
 
-            delete[] buf;
             return CR_OK;
 
         case RPC_REPLY_TEXT:
             text_data.Clear();
-            if (text_data.ParseFromArray(buf, header.size))
+            if (text_data.ParseFromArray(data, buf.size()))
                 text_decoder.decode(&text_data);
             else
                 out.printerr("In call to %s::%s: received invalid text data.\n",
@@ -438,6 +539,5 @@ command_result RemoteFunctionBase::execute(color_ostream &out,
         default:
             break;
         }
-        delete[] buf;
     }
 }
@@ -55,9 +55,19 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <cstdio>
 #include <cstdlib>
 #include <sstream>
+#include <algorithm>
 
 #include <memory>
 
+#ifdef _LINUX
+#include <set>
+#include <deque>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#endif
+
 using namespace DFHack;
 
 #include "tinythread.h"
@@ -69,7 +79,18 @@ using google::protobuf::MessageLite;
 
 bool readFullBuffer(CSimpleSocket *socket, void *buf, int size);
 bool sendRemoteMessage(CSimpleSocket *socket, int16_t id,
-                        const ::google::protobuf::MessageLite *msg, bool size_ready);
+                        const ::google::protobuf::MessageLite *msg, bool size_ready,
+                        bool compress, RPCTransportStats *stats);
+int remoteMessageWireSize(const RPCMessageHeader &header);
+bool unpackRemoteMessage(const RPCMessageHeader &header, std::vector<uint8_t> &buf,
+                         RPCTransportStats *stats);
+
+static void printTransportStats(const RPCTransportStats &stats)
+{
+    std::cerr << "  sent " << stats.raw_sent << " bytes (" << stats.wire_sent << " on the wire), "
+              << "received " << stats.raw_received << " bytes (" << stats.wire_received << " on the wire)."
+              << endl;
+}
 
 
 RPCService::RPCService()
@@ -108,15 +129,19 @@ void RPCService::finalize(ServerConnection *owner, std::vector<ServerFunctionBas
     }
 }
 
-ServerConnection::ServerConnection(CActiveSocket *socket)
+ServerConnection::ServerConnection(CActiveSocket *socket, bool threaded)
     : socket(socket), stream(this)
 {
     in_error = false;
+    compress = false;
 
     core_service = new CoreService();
     core_service->finalize(this, &functions);
 
-    thread = new tthread::thread(threadFn, (void*)this);
+    if (threaded)
+        thread = new tthread::thread(threadFn, (void*)this);
+    else
+        thread = NULL;
 }
 
 ServerConnection::~ServerConnection()
@@ -188,7 +213,8 @@ void ServerConnection::connection_ostream::flush_proxy()
 
     buffer.clear();
 
-    if (!sendRemoteMessage(owner->socket, RPC_REPLY_TEXT, &msg, false))
+    if (!sendRemoteMessage(owner->socket, RPC_REPLY_TEXT, &msg, false,
+                           owner->compress, &owner->stats))
     {
         owner->in_error = true;
         Core::printerr("Error writing text into client socket.\n");
@@ -204,6 +230,120 @@ void ServerConnection::threadFn(void *arg)
     delete me;
 }
 
+bool ServerConnection::handshake(color_ostream &out, RPCHandshakeHeader &header)
+{
+    if (memcmp(header.magic, RPCHandshakeHeader::REQUEST_MAGIC, sizeof(header.magic)) ||
+        header.version < 1 || header.version > 255)
+    {
+        out << "In RPC server: invalid handshake header." << endl;
+        return false;
+    }
+
+    memcpy(header.magic, RPCHandshakeHeader::RESPONSE_MAGIC, sizeof(header.magic));
+    if (header.version > RPCHandshakeHeader::CURRENT_VERSION)
+        header.version = RPCHandshakeHeader::CURRENT_VERSION;
+    compress = (header.version >= 2);
+
+    if (socket->Send((uint8*)&header, sizeof(header)) != sizeof(header))
+    {
+        out << "In RPC server: could not send handshake response." << endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool ServerConnection::dispatch(color_ostream &out, RPCMessageHeader &header, std::vector<uint8_t> &buf)
+{
+    //out.print("Handling %d:%d\n", header.id, header.size);
+
+    if (!unpackRemoteMessage(header, buf, &stats))
+    {
+        out.printerr("In RPC server: could not decompress received data.\n");
+        return false;
+    }
+
+    // Find and call the function
+    int in_size = buf.size();
+
+    ServerFunctionBase *fn = vector_get(functions, header.id);
+    MessageLite *reply = NULL;
+    command_result res = CR_FAILURE;
+
+    if (!fn)
+    {
+        stream.printerr("RPC call of invalid id %d\n", header.id);
+    }
+    else
+    {
+        if (!fn->in()->ParseFromArray(buf.empty() ? NULL : &buf[0], in_size))
+        {
+            stream.printerr("In call to %s: could not decode input args.\n", fn->name);
+        }
+        else
+        {
+            reply = fn->out();
+
+            if (fn->flags & SF_DONT_SUSPEND)
+            {
+                res = fn->execute(stream);
+            }
+            else
+            {
+                CoreSuspender suspend;
+                res = fn->execute(stream);
+            }
+        }
+    }
+
+    // Flush all text output
+    if (in_error)
+        return false;
+
+    //out.print("Answer %d:%d\n", res, reply);
+
+    // Send reply
+    int out_size = (reply ? reply->ByteSize() : 0);
+
+    if (out_size > RPCMessageHeader::MAX_MESSAGE_SIZE)
+    {
+        stream.printerr("In call to %s: reply too large: %d.\n",
+                            (fn ? fn->name : "UNKNOWN"), out_size);
+        res = CR_LINK_FAILURE;
+    }
+
+    stream.flush();
+
+    if (res == CR_OK && reply)
+    {
+        if (!sendRemoteMessage(socket, RPC_REPLY_RESULT, reply, true, compress, &stats))
+        {
+            out.printerr("In RPC server: I/O error in send result.\n");
+            return false;
+        }
+    }
+    else
+    {
+        header.id = RPC_REPLY_FAIL;
+        header.size = res;
+
+        if (socket->Send((uint8_t*)&header, sizeof(header)) != sizeof(header))
+        {
+            out.printerr("In RPC server: I/O error in send failure code.\n");
+            return false;
+        }
+    }
+
+    // Cleanup
+    if (fn)
+    {
+        fn->reset((fn->flags & SF_CALLED_ONCE) ||
+                  (out_size > 128*1024 || in_size > 32*1024));
+    }
+
+    return !in_error;
+}
+
 void ServerConnection::threadFn()
 {
     color_ostream_proxy out(Core::getInstance().getConsole());
@@ -219,21 +359,8 @@ void ServerConnection::threadFn()
             return;
         }
 
-        if (memcmp(header.magic, RPCHandshakeHeader::REQUEST_MAGIC, sizeof(header.magic)) ||
-            header.version < 1 || header.version > 255)
-        {
-            out << "In RPC server: invalid handshake header." << endl;
-            return;
-        }
-
-        memcpy(header.magic, RPCHandshakeHeader::RESPONSE_MAGIC, sizeof(header.magic));
-        header.version = 1;
-
-        if (socket->Send((uint8*)&header, sizeof(header)) != sizeof(header))
-        {
-            out << "In RPC server: could not send handshake response." << endl;
+        if (!handshake(out, header))
             return;
-        }
     }
 
     /* Processing */
@@ -253,109 +380,337 @@ void ServerConnection::threadFn()
         if ((DFHack::DFHackReplyCode)header.id == RPC_REQUEST_QUIT)
             break;
 
-        if (header.size < 0 || header.size > RPCMessageHeader::MAX_MESSAGE_SIZE)
+        int wire_size = remoteMessageWireSize(header);
+
+        if (wire_size < 0)
         {
             out.printerr("In RPC server: invalid received size %d.\n", header.size);
             break;
         }
 
-        std::auto_ptr<uint8_t> buf(new uint8_t[header.size]);
+        std::vector<uint8_t> buf(wire_size);
 
-        if (!readFullBuffer(socket, buf.get(), header.size))
+        if (wire_size > 0 && !readFullBuffer(socket, &buf[0], wire_size))
         {
-            out.printerr("In RPC server: I/O error in receive %d bytes of data.\n", header.size);
+            out.printerr("In RPC server: I/O error in receive %d bytes of data.\n", wire_size);
             break;
         }
 
-        //out.print("Handling %d:%d\n", header.id, header.size);
+        if (!dispatch(out, header, buf))
+            break;
+    }
+
+    std::cerr << "Shutting down client connection." << endl;
+    printTransportStats(stats);
+}
+
+#ifdef _LINUX
+
+/*
+ * Event-driven connection manager.
+ *
+ * A single thread polls all client sockets via epoll and reads
+ * requests without blocking; complete requests are handed over to
+ * a fixed pool of worker threads. A client is not polled while its
+ * request is being executed, so each connection has at most one
+ * request in flight, and a flooding client just fills its own
+ * socket buffer.
+ */
+
+namespace DFHack {
+    class ServerReactor {
+        struct Client {
+            enum State { HANDSHAKE, HEADER, BODY, BUSY };
+
+            ServerConnection *conn;
+            int fd;
+            State state;
+
+            RPCHandshakeHeader handshake;
+            RPCMessageHeader header;
+            std::vector<uint8_t> body;
+            size_t got;
+        };
+
+        CPassiveSocket *listener;
+        int epoll_fd;
+        int max_clients;
+
+        tthread::mutex lock;
+        tthread::condition_variable queue_cond;
+        std::set<Client*> clients;
+        std::deque<Client*> queue;
+
+        tthread::thread *thread;
+        std::vector<tthread::thread*> workers;
+
+        static void reactorFn(void *arg) { ((ServerReactor*)arg)->reactorFn(); }
+        static void workerFn(void *arg) { ((ServerReactor*)arg)->workerFn(); }
+        void reactorFn();
+        void workerFn();
+
+        bool arm(Client *client, int op);
+        void acceptClient(color_ostream &out);
+        bool receive(color_ostream &out, Client *client);
+        void closeClient(Client *client);
+
+    public:
+        ServerReactor(CPassiveSocket *listener)
+            : listener(listener), epoll_fd(-1), max_clients(0), thread(NULL) {}
+
+        bool start(int num_workers, int max_clients);
+    };
+}
+
+bool ServerReactor::start(int num_workers, int max_clients)
+{
+    this->max_clients = max_clients;
+
+    epoll_fd = epoll_create(max_clients+1);
+    if (epoll_fd < 0)
+        return false;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listener->GetSocketDescriptor(), &ev) != 0)
+    {
+        ::close(epoll_fd);
+        epoll_fd = -1;
+        return false;
+    }
+
+    for (int i = 0; i < num_workers; i++)
+        workers.push_back(new tthread::thread(workerFn, this));
 
-        // Find and call the function
-        int in_size = header.size;
+    thread = new tthread::thread(reactorFn, this);
+    return true;
+}
 
-        ServerFunctionBase *fn = vector_get(functions, header.id);
-        MessageLite *reply = NULL;
-        command_result res = CR_FAILURE;
+bool ServerReactor::arm(Client *client, int op)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = client;
 
-        if (!fn)
+    return epoll_ctl(epoll_fd, op, client->fd, &ev) == 0;
+}
+
+void ServerReactor::acceptClient(color_ostream &out)
+{
+    CActiveSocket *socket = listener->Accept();
+    if (!socket)
+        return;
+
+    size_t count;
+    {
+        tthread::lock_guard<tthread::mutex> guard(lock);
+        count = clients.size();
+    }
+
+    if (count >= size_t(max_clients))
+    {
+        out.printerr("In RPC server: too many clients (%d), rejecting connection.\n", max_clients);
+        socket->Close();
+        delete socket;
+        return;
+    }
+
+    Client *client = new Client();
+    client->conn = new ServerConnection(socket, false);
+    client->fd = socket->GetSocketDescriptor();
+    client->state = Client::HANDSHAKE;
+    client->got = 0;
+
+    {
+        tthread::lock_guard<tthread::mutex> guard(lock);
+        clients.insert(client);
+    }
+
+    if (!arm(client, EPOLL_CTL_ADD))
+        closeClient(client);
+}
+
+void ServerReactor::closeClient(Client *client)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+
+    {
+        tthread::lock_guard<tthread::mutex> guard(lock);
+        clients.erase(client);
+    }
+
+    if (client->state != Client::HANDSHAKE)
+    {
+        std::cerr << "Shutting down client connection." << endl;
+        printTransportStats(client->conn->stats);
+    }
+
+    delete client->conn;
+    delete client;
+}
+
+bool ServerReactor::receive(color_ostream &out, Client *client)
+{
+    for (;;)
+    {
+        uint8_t *ptr;
+        size_t want;
+        int wire_size;
+
+        switch (client->state)
         {
-            stream.printerr("RPC call of invalid id %d\n", header.id);
+        case Client::HANDSHAKE:
+            ptr = (uint8_t*)&client->handshake;
+            want = sizeof(client->handshake);
+            break;
+        case Client::HEADER:
+            ptr = (uint8_t*)&client->header;
+            want = sizeof(client->header);
+            break;
+        case Client::BODY:
+            ptr = client->body.empty() ? NULL : &client->body[0];
+            want = client->body.size();
+            break;
+        default:
+            return true;
         }
-        else
+
+        if (client->got < want)
         {
-            if (!fn->in()->ParseFromArray(buf.get(), header.size))
-            {
-                stream.printerr("In call to %s: could not decode input args.\n", fn->name);
-            }
-            else
+            ssize_t cnt = recv(client->fd, ptr + client->got, want - client->got, MSG_DONTWAIT);
+
+            if (cnt == 0)
+                return false;
+            if (cnt < 0)
+                return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+
+            client->got += cnt;
+            continue;
+        }
+
+        client->got = 0;
+
+        switch (client->state)
+        {
+        case Client::HANDSHAKE:
+            if (!client->conn->handshake(out, client->handshake))
+                return false;
+
+            std::cerr << "Client connection established." << endl;
+            client->state = Client::HEADER;
+            break;
+
+        case Client::HEADER:
+            if ((DFHack::DFHackReplyCode)client->header.id == RPC_REQUEST_QUIT)
+                return false;
+
+            wire_size = remoteMessageWireSize(client->header);
+
+            if (wire_size < 0)
             {
-                buf.reset();
-
-                reply = fn->out();
-
-                if (fn->flags & SF_DONT_SUSPEND)
-                {
-                    res = fn->execute(stream);
-                }
-                else
-                {
-                    CoreSuspender suspend;
-                    res = fn->execute(stream);
-                }
+                out.printerr("In RPC server: invalid received size %d.\n", client->header.size);
+                return false;
             }
-        }
 
-        // Flush all text output
-        if (in_error)
+            client->body.resize(wire_size);
+            client->state = Client::BODY;
             break;
 
-        //out.print("Answer %d:%d\n", res, reply);
+        default:
+            client->state = Client::BUSY;
+            return true;
+        }
+    }
+}
+
+void ServerReactor::reactorFn()
+{
+    color_ostream_proxy out(Core::getInstance().getConsole());
+
+    struct epoll_event events[32];
 
-        // Send reply
-        int out_size = (reply ? reply->ByteSize() : 0);
+    for (;;)
+    {
+        int cnt = epoll_wait(epoll_fd, events, 32, -1);
 
-        if (out_size > RPCMessageHeader::MAX_MESSAGE_SIZE)
+        if (cnt < 0)
         {
-            stream.printerr("In call to %s: reply too large: %d.\n",
-                                (fn ? fn->name : "UNKNOWN"), out_size);
-            res = CR_LINK_FAILURE;
-        }
+            if (errno == EINTR)
+                continue;
 
-        stream.flush();
+            out.printerr("In RPC server: epoll_wait failed: %s\n", strerror(errno));
+            break;
+        }
 
-        if (res == CR_OK && reply)
+        for (int i = 0; i < cnt; i++)
         {
-            if (!sendRemoteMessage(socket, RPC_REPLY_RESULT, reply, true))
+            Client *client = (Client*)events[i].data.ptr;
+
+            if (!client)
             {
-                out.printerr("In RPC server: I/O error in send result.\n");
-                break;
+                acceptClient(out);
+                continue;
+            }
+
+            if (!receive(out, client))
+            {
+                closeClient(client);
+                continue;
             }
-        }
-        else
-        {
-            header.id = RPC_REPLY_FAIL;
-            header.size = res;
 
-            if (socket->Send((uint8_t*)&header, sizeof(header)) != sizeof(header))
+            if (client->state == Client::BUSY)
             {
-                out.printerr("In RPC server: I/O error in send failure code.\n");
-                break;
+                tthread::lock_guard<tthread::mutex> guard(lock);
+                queue.push_back(client);
+                queue_cond.notify_one();
             }
+            else if (!arm(client, EPOLL_CTL_MOD))
+                closeClient(client);
         }
+    }
+}
+
+void ServerReactor::workerFn()
+{
+    color_ostream_proxy out(Core::getInstance().getConsole());
+
+    for (;;)
+    {
+        Client *client;
 
-        // Cleanup
-        if (fn)
         {
-            fn->reset((fn->flags & SF_CALLED_ONCE) ||
-                      (out_size > 128*1024 || in_size > 32*1024));
+            tthread::lock_guard<tthread::mutex> guard(lock);
+
+            while (queue.empty())
+                queue_cond.wait(lock);
+
+            client = queue.front();
+            queue.pop_front();
         }
-    }
 
-    std::cerr << "Shutting down client connection." << endl;
+        bool ok = client->conn->dispatch(out, client->header, client->body);
+
+        // Don't hold on to buffers of huge requests
+        if (client->body.capacity() > 32*1024)
+            std::vector<uint8_t>().swap(client->body);
+
+        client->state = Client::HEADER;
+
+        if (!ok || !arm(client, EPOLL_CTL_MOD))
+            closeClient(client);
+    }
 }
 
+#endif
+
 ServerMain::ServerMain()
 {
     socket = new CPassiveSocket();
+    reactor = NULL;
     thread = NULL;
 }
 
@@ -365,9 +720,31 @@ ServerMain::~ServerMain()
     delete socket;
 }
 
+int ServerMain::GetWorkerCount()
+{
+    const char *val = getenv("DFHACK_RPC_WORKERS");
+    int count = val ? atoi(val) : 0;
+
+    if (count <= 0)
+        return 4;
+    else
+        return std::min(count, 64);
+}
+
+int ServerMain::GetMaxClients()
+{
+    const char *val = getenv("DFHACK_RPC_MAX_CLIENTS");
+    int count = val ? atoi(val) : 0;
+
+    if (count <= 0)
+        return 32;
+    else
+        return count;
+}
+
 bool ServerMain::listen(int port)
 {
-    if (thread)
+    if (thread || reactor)
         return true;
 
     socket->Initialize();
@@ -375,6 +752,16 @@ bool ServerMain::listen(int port)
     if (!socket->Listen((const uint8 *)"127.0.0.1", port))
         return false;
 
+#ifdef _LINUX
+    reactor = new ServerReactor(socket);
+    if (reactor->start(GetWorkerCount(), GetMaxClients()))
+        return true;
+
+    std::cerr << "Could not start the RPC reactor, using a thread per connection." << endl;
+    delete reactor;
+    reactor = NULL;
+#endif
+
     thread = new tthread::thread(threadFn, this);
     return true;
 }
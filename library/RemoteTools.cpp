@@ -49,6 +49,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "PluginManager.h"
 #include "MiscUtils.h"
 #include "VersionInfo.h"
+#include "LuaTools.h"
 
 #include "modules/Materials.h"
 #include "modules/Translation.h"
@@ -83,6 +84,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <sstream>
 
 #include <memory>
+#include <algorithm>
 
 using namespace DFHack;
 using namespace df::enums;
@@ -562,18 +564,15 @@ static command_result ListMaterials(color_ostream &stream,
     return out->value_size() ? CR_OK : CR_NOT_FOUND;
 }
 
-static command_result ListUnits(color_ostream &stream,
-                                const ListUnitsIn *in, ListUnitsOut *out)
+static void collectUnits(std::vector<df::unit*> *units, const ListUnitsIn *in)
 {
-    auto mask = in->has_mask() ? &in->mask() : NULL;
-
     if (in->id_list_size() > 0)
     {
         for (int i = 0; i < in->id_list_size(); i++)
         {
             auto unit = df::unit::find(in->id_list(i));
             if (unit)
-                describeUnit(out->add_value(), unit, mask);
+                units->push_back(unit);
         }
     }
 
@@ -596,13 +595,138 @@ static command_result ListUnits(color_ostream &stream,
             if (in->has_sane() && Units::isSane(unit) != in->sane())
                 continue;
 
-            describeUnit(out->add_value(), unit, mask);
+            units->push_back(unit);
         }
     }
+}
+
+static command_result ListUnits(color_ostream &stream,
+                                const ListUnitsIn *in, ListUnitsOut *out)
+{
+    auto mask = in->has_mask() ? &in->mask() : NULL;
+
+    std::vector<df::unit*> units;
+    collectUnits(&units, in);
+
+    for (size_t i = 0; i < units.size(); i++)
+        describeUnit(out->add_value(), units[i], mask);
 
     return out->value_size() ? CR_OK : CR_NOT_FOUND;
 }
 
+static command_result ExportUnitsColumnar(color_ostream &stream,
+                                          const ExportUnitsColumnarIn *in,
+                                          ExportUnitsColumnarOut *out)
+{
+    std::vector<df::unit*> units;
+    collectUnits(&units, &in->filter());
+
+    if (units.empty())
+        return CR_NOT_FOUND;
+
+    int count = units.size();
+    int num_labors = sizeof(units[0]->status.labors)/sizeof(bool);
+
+    // Map skill ids to their output columns, so that every
+    // unit's skill vector is walked only once.
+    std::vector<int> skill_column(ENUM_LAST_ITEM(job_skill)+1, -1);
+    std::vector<UnitSkillColumn*> skills;
+
+    for (int i = 0; i < in->skills_size(); i++)
+    {
+        int id = in->skills(i);
+        if (id < 0 || id > ENUM_LAST_ITEM(job_skill))
+        {
+            stream.printerr("Invalid skill id: %d\n", id);
+            return CR_WRONG_USAGE;
+        }
+
+        auto column = out->add_skills();
+        column->set_skill(id);
+        column->mutable_level()->Reserve(count);
+
+        if (skill_column[id] < 0)
+            skill_column[id] = i;
+        skills.push_back(column);
+    }
+
+    std::vector<UnitLaborColumn*> labors;
+
+    for (int i = 0; i < in->labors_size(); i++)
+    {
+        int id = in->labors(i);
+        if (id < 0 || id >= num_labors)
+        {
+            stream.printerr("Invalid labor id: %d\n", id);
+            return CR_WRONG_USAGE;
+        }
+
+        auto column = out->add_labors();
+        column->set_labor(id);
+        column->mutable_enabled()->Reserve(count);
+        labors.push_back(column);
+    }
+
+    out->mutable_unit_id()->Reserve(count);
+    out->mutable_pos_x()->Reserve(count);
+    out->mutable_pos_y()->Reserve(count);
+    out->mutable_pos_z()->Reserve(count);
+    out->mutable_flags1()->Reserve(count);
+    out->mutable_flags2()->Reserve(count);
+    out->mutable_flags3()->Reserve(count);
+    out->mutable_race()->Reserve(count);
+    out->mutable_caste()->Reserve(count);
+    out->mutable_civ_id()->Reserve(count);
+    if (in->profession())
+        out->mutable_profession()->Reserve(count);
+
+    std::vector<int> levels(skills.size());
+
+    for (int i = 0; i < count; i++)
+    {
+        auto unit = units[i];
+
+        out->add_unit_id(unit->id);
+        out->add_pos_x(unit->pos.x);
+        out->add_pos_y(unit->pos.y);
+        out->add_pos_z(unit->pos.z);
+        out->add_flags1(unit->flags1.whole);
+        out->add_flags2(unit->flags2.whole);
+        out->add_flags3(unit->flags3.whole);
+        out->add_race(unit->race);
+        out->add_caste(unit->caste);
+        out->add_civ_id(unit->civ_id);
+
+        if (in->profession())
+            out->add_profession(unit->profession);
+
+        if (!skills.empty())
+        {
+            std::fill(levels.begin(), levels.end(), -1);
+
+            if (auto soul = unit->status.current_soul)
+            {
+                for (size_t j = 0; j < soul->skills.size(); j++)
+                {
+                    auto skill = soul->skills[j];
+                    int id = skill->id;
+                    if (id >= 0 && id <= ENUM_LAST_ITEM(job_skill) && skill_column[id] >= 0)
+                        levels[skill_column[id]] = skill->rating;
+                }
+            }
+
+            // The same skill may be requested twice
+            for (size_t j = 0; j < skills.size(); j++)
+                skills[j]->add_level(levels[skill_column[skills[j]->skill()]]);
+        }
+
+        for (size_t j = 0; j < labors.size(); j++)
+            labors[j]->add_enabled(unit->status.labors[labors[j]->labor()]);
+    }
+
+    return CR_OK;
+}
+
 static command_result ListSquads(color_ostream &stream,
                                  const ListSquadsIn *in, ListSquadsOut *out)
 {
@@ -645,6 +769,13 @@ static command_result SetUnitLabors(color_ostream &stream, const SetUnitLaborsIn
     return CR_OK;
 }
 
+static command_result CallLuaMethod(color_ostream &stream,
+                                    const CoreCallLuaRequest *in, CoreCallLuaReply *out)
+{
+    return Lua::Core::CallRPCMethod(stream, in->method(), in->argument(),
+                                    out->mutable_result());
+}
+
 CoreService::CoreService() {
     suspend_depth = 0;
 
@@ -667,9 +798,12 @@ CoreService::CoreService() {
 
     addFunction("ListMaterials", ListMaterials, SF_CALLED_ONCE);
     addFunction("ListUnits", ListUnits);
+    addFunction("ExportUnitsColumnar", ExportUnitsColumnar);
     addFunction("ListSquads", ListSquads);
 
     addFunction("SetUnitLabors", SetUnitLabors);
+
+    addFunction("CallLuaMethod", CallLuaMethod);
 }
 
 CoreService::~CoreService()
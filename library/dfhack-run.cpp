@@ -53,10 +53,493 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <memory>
 
+#ifdef LINUX_BUILD
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
 using namespace DFHack;
 using namespace dfproto;
 using std::cout;
 
+static const int16_t RUN_COMMAND_ID = 1;
+
+class null_ostream : public color_ostream
+{
+protected:
+    virtual void add_text(color_value, const std::string &) {}
+};
+
+static int report_result(color_ostream &out, const std::string &cmd, command_result rv)
+{
+    if (rv != CR_OK) {
+        if (rv == CR_NOT_IMPLEMENTED)
+            out.printerr("%s is not a recognized command.\n", cmd.c_str());
+
+        return 1;
+    }
+
+    out.flush();
+    return 0;
+}
+
+#ifdef LINUX_BUILD
+
+/*
+ * Daemon mode.
+ *
+ * 'dfhack-run --daemon' keeps one connection to DFHack open and
+ * accepts commands on a unix domain socket, so that invocations
+ * from scripts don't have to redo the TCP handshake every time.
+ * Requests and replies reuse the RPC framing: the client sends a
+ * RunCommand request, and the daemon replies with any number of
+ * RPC_REPLY_TEXT messages, followed by an RPC_REPLY_FAIL header
+ * holding the command result code (CR_OK on success).
+ */
+
+/*
+ * The socket lives in a directory that only the current user can
+ * access: $XDG_RUNTIME_DIR if set, or /tmp/dfhack-run-<uid> otherwise.
+ */
+static std::string daemon_socket_dir()
+{
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    if (dir && *dir)
+        return dir;
+
+    std::stringstream ss;
+    ss << "/tmp/dfhack-run-" << getuid();
+    return ss.str();
+}
+
+static std::string daemon_socket_path()
+{
+    const char *path = getenv("DFHACK_RUN_SOCKET");
+    if (path && *path)
+        return path;
+
+    std::stringstream ss;
+    ss << daemon_socket_dir() << "/dfhack-run-" << RemoteClient::GetDefaultPort() << ".sock";
+    return ss.str();
+}
+
+static bool is_private_dir(const std::string &dir)
+{
+    struct stat st;
+    if (lstat(dir.c_str(), &st) != 0)
+        return false;
+
+    return S_ISDIR(st.st_mode) && st.st_uid == getuid() && (st.st_mode & 077) == 0;
+}
+
+static bool is_own_socket(const std::string &path)
+{
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0)
+        return false;
+
+    return S_ISSOCK(st.st_mode) && st.st_uid == getuid();
+}
+
+// Checks that the process on the other end runs as the current user
+static bool is_own_peer(int fd)
+{
+#ifdef _DARWIN
+    uid_t uid;
+    gid_t gid;
+    if (getpeereid(fd, &uid, &gid) != 0)
+        return false;
+
+    return uid == getuid();
+#else
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+        return false;
+
+    return cred.uid == getuid();
+#endif
+}
+
+// Keeps a client that stalls mid-request from blocking the daemon
+static bool set_client_timeout(int fd, int seconds)
+{
+    struct timeval tv;
+    tv.tv_sec = seconds;
+    tv.tv_usec = 0;
+
+    return setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0 &&
+           setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == 0;
+}
+
+static bool make_address(sockaddr_un *addr, const std::string &path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    if (path.size() >= sizeof(addr->sun_path))
+        return false;
+
+    strcpy(addr->sun_path, path.c_str());
+    return true;
+}
+
+static bool write_full(int fd, const void *buf, size_t size)
+{
+    const char *ptr = (const char*)buf;
+    while (size > 0) {
+        ssize_t cnt = write(fd, ptr, size);
+        if (cnt < 0 && errno == EINTR)
+            continue;
+        if (cnt <= 0)
+            return false;
+        ptr += cnt;
+        size -= cnt;
+    }
+
+    return true;
+}
+
+static bool read_full(int fd, void *buf, size_t size)
+{
+    char *ptr = (char*)buf;
+    while (size > 0) {
+        ssize_t cnt = read(fd, ptr, size);
+        if (cnt < 0 && errno == EINTR)
+            continue;
+        if (cnt <= 0)
+            return false;
+        ptr += cnt;
+        size -= cnt;
+    }
+
+    return true;
+}
+
+static bool send_code(int fd, int16_t id, int32_t size)
+{
+    RPCMessageHeader header;
+    header.id = id;
+    header.size = size;
+    return write_full(fd, &header, sizeof(header));
+}
+
+static bool send_message(int fd, int16_t id, const google::protobuf::MessageLite *msg)
+{
+    std::string data;
+    if (!msg->SerializeToString(&data))
+        return false;
+
+    return send_code(fd, id, data.size()) && write_full(fd, data.data(), data.size());
+}
+
+static bool read_message(int fd, RPCMessageHeader *header, std::string *data)
+{
+    if (!read_full(fd, header, sizeof(*header)))
+        return false;
+
+    if ((DFHack::DFHackReplyCode)header->id == RPC_REPLY_FAIL)
+        return true;
+
+    if (header->size < 0 || header->size > RPCMessageHeader::MAX_MESSAGE_SIZE)
+        return false;
+
+    data->resize(header->size);
+    return header->size == 0 || read_full(fd, &(*data)[0], header->size);
+}
+
+class daemon_ostream : public buffered_color_ostream
+{
+    int fd;
+    bool in_error;
+
+protected:
+    virtual void flush_proxy()
+    {
+        if (in_error || buffer.empty())
+        {
+            buffer.clear();
+            return;
+        }
+
+        CoreTextNotification msg;
+
+        for (auto it = buffer.begin(); it != buffer.end(); ++it)
+        {
+            auto frag = msg.add_fragments();
+            frag->set_text(it->second);
+            if (it->first >= 0)
+                frag->set_color(CoreTextFragment::Color(it->first));
+        }
+
+        buffer.clear();
+
+        if (!send_message(fd, RPC_REPLY_TEXT, &msg))
+            in_error = true;
+    }
+
+public:
+    daemon_ostream(int fd) : fd(fd), in_error(false) {}
+};
+
+static void serve_request(color_ostream &out, RemoteClient *&client, int fd)
+{
+    RPCMessageHeader header;
+    std::string data;
+    CoreRunCommandRequest request;
+
+    if (!read_message(fd, &header, &data) || header.id != RUN_COMMAND_ID ||
+        !request.ParseFromString(data))
+    {
+        out.printerr("dfhack-run: invalid request received.\n");
+        return;
+    }
+
+    std::vector<std::string> args(request.arguments().begin(), request.arguments().end());
+
+    daemon_ostream stream(fd);
+    command_result rv = CR_LINK_FAILURE;
+
+    // A cached connection may have gone stale if DF was restarted,
+    // so allow one reconnect in that case.
+    bool fresh = false;
+
+    while (rv == CR_LINK_FAILURE)
+    {
+        if (!client)
+        {
+            if (fresh)
+                break;
+
+            fresh = true;
+            client = new RemoteClient(&out);
+
+            if (!client->connect())
+            {
+                delete client;
+                client = NULL;
+                stream.printerr("Could not connect to DFHack.\n");
+                break;
+            }
+        }
+
+        rv = client->run_command(stream, request.command(), args);
+
+        if (rv == CR_LINK_FAILURE)
+        {
+            delete client;
+            client = NULL;
+        }
+    }
+
+    stream.flush();
+    send_code(fd, RPC_REPLY_FAIL, rv);
+}
+
+static const int DAEMON_CLIENT_TIMEOUT = 5;
+
+static int run_daemon(color_ostream &out)
+{
+    std::string path = daemon_socket_path();
+    sockaddr_un addr;
+
+    if (!make_address(&addr, path))
+    {
+        out.printerr("Socket path too long: %s\n", path.c_str());
+        return 2;
+    }
+
+    if (!getenv("DFHACK_RUN_SOCKET"))
+    {
+        std::string dir = daemon_socket_dir();
+        mkdir(dir.c_str(), 0700);
+
+        if (!is_private_dir(dir))
+        {
+            out.printerr("Refusing to use %s: it must be a directory owned by you "
+                         "and not accessible to others.\n", dir.c_str());
+            return 2;
+        }
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+    {
+        out.printerr("Could not create socket: %s\n", strerror(errno));
+        return 2;
+    }
+
+    unlink(path.c_str());
+
+    mode_t old_mask = umask(077);
+    int rc = bind(listen_fd, (sockaddr*)&addr, sizeof(addr));
+    umask(old_mask);
+
+    if (rc != 0 || listen(listen_fd, 16) != 0)
+    {
+        out.printerr("Could not listen on %s: %s\n", path.c_str(), strerror(errno));
+        close(listen_fd);
+        return 2;
+    }
+
+    // Clients that go away mid-reply must not kill the daemon
+    signal(SIGPIPE, SIG_IGN);
+
+    out.print("dfhack-run: listening on %s\n", path.c_str());
+    out.flush();
+
+    RemoteClient *client = NULL;
+
+    for (;;)
+    {
+        int fd = accept(listen_fd, NULL, NULL);
+
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            out.printerr("Accept failed: %s\n", strerror(errno));
+            break;
+        }
+
+        if (is_own_peer(fd) && set_client_timeout(fd, DAEMON_CLIENT_TIMEOUT))
+            serve_request(out, client, fd);
+        close(fd);
+    }
+
+    delete client;
+    close(listen_fd);
+    unlink(path.c_str());
+    return 2;
+}
+
+/*
+ * Runs the command through the daemon. Sets reached to false,
+ * and does nothing else, if there is no daemon to talk to, or
+ * if the socket or the daemon belong to another user.
+ */
+static command_result run_via_daemon(color_ostream &out, const std::string &cmd,
+                                     const std::vector<std::string> &args, bool *reached)
+{
+    *reached = false;
+
+    std::string path = daemon_socket_path();
+    sockaddr_un addr;
+    if (!make_address(&addr, path) || !is_own_socket(path))
+        return CR_LINK_FAILURE;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return CR_LINK_FAILURE;
+
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0 || !is_own_peer(fd))
+    {
+        close(fd);
+        return CR_LINK_FAILURE;
+    }
+
+    *reached = true;
+
+    CoreRunCommandRequest request;
+    request.set_command(cmd);
+    for (size_t i = 0; i < args.size(); i++)
+        request.add_arguments(args[i]);
+
+    command_result rv = CR_LINK_FAILURE;
+    bool done = false;
+
+    if (send_message(fd, RUN_COMMAND_ID, &request))
+    {
+        color_ostream_proxy text_decoder(out);
+        CoreTextNotification text_data;
+        RPCMessageHeader header;
+        std::string data;
+
+        while (read_message(fd, &header, &data))
+        {
+            if ((DFHack::DFHackReplyCode)header.id == RPC_REPLY_FAIL)
+            {
+                rv = command_result(header.size);
+                done = true;
+                break;
+            }
+
+            if ((DFHack::DFHackReplyCode)header.id == RPC_REPLY_TEXT)
+            {
+                text_data.Clear();
+                if (text_data.ParseFromString(data))
+                    text_decoder.decode(&text_data);
+            }
+        }
+    }
+
+    if (!done)
+        out.printerr("Lost connection to the dfhack-run daemon.\n");
+
+    close(fd);
+    return rv;
+}
+
+static double now_seconds()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static void print_rate(color_ostream &out, const char *mode, int count, double elapsed)
+{
+    out.print("%-9s %d calls in %.3f s, %.1f calls/s\n",
+              mode, count, elapsed, elapsed > 0 ? count / elapsed : 0.0);
+}
+
+/*
+ * Compares invocation throughput of the one-shot client against the
+ * daemon. Process startup is not included in either number.
+ */
+static int run_bench(color_ostream &out, int count, const std::string &cmd,
+                     const std::vector<std::string> &args)
+{
+    null_ostream sink;
+
+    double start = now_seconds();
+    for (int i = 0; i < count; i++)
+    {
+        RemoteClient client(&sink);
+        if (!client.connect())
+        {
+            out.printerr("Could not connect to DFHack.\n");
+            return 2;
+        }
+
+        client.run_command(sink, cmd, args);
+    }
+    print_rate(out, "one-shot:", count, now_seconds() - start);
+
+    bool reached;
+    start = now_seconds();
+    for (int i = 0; i < count; i++)
+    {
+        run_via_daemon(sink, cmd, args, &reached);
+        if (!reached)
+        {
+            out.printerr("No daemon is listening on %s\n", daemon_socket_path().c_str());
+            return 2;
+        }
+    }
+    print_rate(out, "daemon:", count, now_seconds() - start);
+
+    return 0;
+}
+
+#endif
+
 int main (int argc, char *argv[])
 {
     color_ostream_wrapper out(cout);
@@ -64,28 +547,56 @@ int main (int argc, char *argv[])
     if (argc <= 1)
     {
         fprintf(stderr, "Usage: dfhack-run <command> [args...]\n");
+#ifdef LINUX_BUILD
+        fprintf(stderr, "       dfhack-run --daemon\n");
+        fprintf(stderr, "       dfhack-run --bench <count> <command> [args...]\n");
+#endif
         return 2;
     }
 
-    // Connect to DFHack
-    RemoteClient client(&out);
-    if (!client.connect())
-        return 2;
+    std::string cmd = argv[1];
+
+#ifdef LINUX_BUILD
+    if (cmd == "--daemon")
+        return run_daemon(out);
+
+    if (cmd == "--bench")
+    {
+        if (argc <= 3 || atoi(argv[2]) <= 0)
+        {
+            fprintf(stderr, "Usage: dfhack-run --bench <count> <command> [args...]\n");
+            return 2;
+        }
+
+        std::vector<std::string> args;
+        for (int i = 4; i < argc; i++)
+            args.push_back(argv[i]);
+
+        return run_bench(out, atoi(argv[2]), argv[3], args);
+    }
+#endif
 
-    // Call the command
     std::vector<std::string> args;
     for (int i = 2; i < argc; i++)
         args.push_back(argv[i]);
 
-    command_result rv = client.run_command(argv[1], args);
+#ifdef LINUX_BUILD
+    // Use the daemon if one is running
+    {
+        bool reached;
+        command_result rv = run_via_daemon(out, cmd, args, &reached);
+        if (reached)
+            return report_result(out, cmd, rv);
+    }
+#endif
 
-    if (rv != CR_OK) {
-        if (rv == CR_NOT_IMPLEMENTED)
-            out.printerr("%s is not a recognized command.\n", argv[1]);
+    // Connect to DFHack
+    RemoteClient client(&out);
+    if (!client.connect())
+        return 2;
 
-        return 1;
-    }
+    // Call the command
+    command_result rv = client.run_command(cmd, args);
 
-    out.flush();
-    return 0;
+    return report_result(out, cmd, rv);
 }
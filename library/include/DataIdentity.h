@@ -123,6 +123,11 @@ namespace DFHack
 
         virtual bool lua_insert(lua_State *state, int fname_idx, void *ptr, int idx, int val_index);
 
+        int getItemCount(void *ptr, CountMode cnt = COUNT_READ) { return item_count(ptr, cnt); }
+        void *getItemPointer(type_identity *item, void *ptr, int idx) {
+            return item_pointer(item, ptr, idx);
+        }
+
     protected:
         virtual int item_count(void *ptr, CountMode cnt) = 0;
         virtual void *item_pointer(type_identity *item, void *ptr, int idx) = 0;
@@ -328,6 +328,21 @@ namespace DFHack {namespace Lua {
 
     DFHACK_EXPORT bool IsCoreContext(lua_State *state);
 
+    /**
+     * Serialize the value at the given index in a compact binary format,
+     * which is a subset of msgpack. Supports nil, booleans, numbers,
+     * strings and tables thereof. Returns false on unsupported values.
+     */
+    DFHACK_EXPORT bool EncodeValue(lua_State *state, int val_index, std::string *out,
+                                   std::string *error = NULL);
+
+    /**
+     * Decode a value in the EncodeValue format and push it on the stack.
+     * Returns false and leaves the stack unchanged if the data is invalid.
+     */
+    DFHACK_EXPORT bool DecodeValue(lua_State *state, const char *data, size_t size,
+                                   std::string *error = NULL);
+
     namespace Event {
         struct DFHACK_EXPORT Owner {
             virtual ~Owner() {}
@@ -377,6 +392,13 @@ namespace DFHack {namespace Lua {
         // Signals timers
         void onUpdate(color_ostream &out);
 
+        /**
+         * Call the function registered via dfhack.rpc.register, passing
+         * the argument and returning the result in EncodeValue format.
+         */
+        DFHACK_EXPORT command_result CallRPCMethod(color_ostream &out, const std::string &name,
+                                                   const std::string &args, std::string *result);
+
         template<class T> inline void Push(T &arg) { Lua::Push(State, arg); }
         template<class T> inline void Push(const T &arg) { Lua::Push(State, arg); }
         template<class T> inline void PushVector(const T &arg) { Lua::PushVector(State, arg); }
@@ -392,15 +414,28 @@ namespace DFHack {namespace Lua {
         }
     }
 
+    /**
+     * While the lua profiler is running, samples taken in the scope of
+     * this object are attributed to the owner "kind:name", e.g. a script
+     * or an event. Does nothing if the profiler is not running.
+     */
+    class DFHACK_EXPORT ProfileScope {
+        bool active;
+    public:
+        ProfileScope(const char *kind, const std::string &name = std::string());
+        ~ProfileScope();
+    };
+
     class DFHACK_EXPORT Notification : public Event::Owner {
         lua_State *state;
         void *key;
         function_identity_base *handler;
         int count;
+        const char *name;
 
     public:
         Notification(function_identity_base *handler = NULL)
-            : state(NULL), key(NULL), handler(handler), count(0) {}
+            : state(NULL), key(NULL), handler(handler), count(0), name(NULL) {}
 
         int get_listener_count() { return count; }
         lua_State *get_state() { return state; }
@@ -67,6 +67,12 @@ namespace DFHack { namespace LuaWrapper {
      */
     extern LuaToken DFHACK_PTR_IDTABLE_TOKEN;
 
+    /**
+     * Registry pkey: ObjectCacheStats userdata; its user value is a hash of
+     * object metatable -> weak-valued table of address -> object ref.
+     */
+    extern LuaToken DFHACK_OBJECT_CACHE_TOKEN;
+
 // Function registry names
 #define DFHACK_CHANGEERROR_NAME "DFHack::ChangeError"
 #define DFHACK_COMPARE_NAME "DFHack::ComparePtrs"
@@ -154,6 +160,20 @@ namespace DFHack { namespace LuaWrapper {
 
     void push_adhoc_pointer(lua_State *state, void *ptr, type_identity *target);
 
+    /**
+     * Optional cache that makes repeated pushes of the same address
+     * with the same type return the same object ref userdata.
+     */
+    struct ObjectCacheStats {
+        bool enabled;
+        uint64_t pushes; // typed refs requested while enabled
+        uint64_t hits;   // ... of which were satisfied from the cache
+    };
+
+    DFHACK_EXPORT ObjectCacheStats *GetObjectCacheStats(lua_State *state);
+    DFHACK_EXPORT void SetObjectCacheEnabled(lua_State *state, bool enable);
+    DFHACK_EXPORT void ClearObjectCache(lua_State *state);
+
     /**
      * Verify that the object is a DF ref with UPVAL_METATABLE.
      * If everything ok, extract the address.
@@ -237,6 +257,16 @@ namespace DFHack { namespace LuaWrapper {
 
     int method_wrapper_core(lua_State *state, function_identity_base *id);
 
+    /**
+     * Implements df.extract: bulk read of field paths from a container of structs.
+     */
+    int bulk_extract(lua_State *state);
+
+    /**
+     * Enables or disables the primitive field fast path in struct __index.
+     */
+    DFHACK_EXPORT void SetFastFieldReads(bool enable);
+
     void IndexStatics(lua_State *state, int meta_idx, int ftable_idx, struct_identity *pstruct);
 
     void AttachDFGlobals(lua_State *state);
@@ -342,6 +342,12 @@ DFHACK_EXPORT int random_int(int max);
  */
 DFHACK_EXPORT uint64_t GetTimeMs64();
 
+/**
+ * Returns a timestamp in microseconds, for measuring short intervals.
+ * Unlike GetTimeMs64, the epoch is unspecified.
+ */
+DFHACK_EXPORT uint64_t GetTimeUs64();
+
 DFHACK_EXPORT std::string stl_sprintf(const char *fmt, ...);
 DFHACK_EXPORT std::string stl_vsprintf(const char *fmt, va_list args);
 
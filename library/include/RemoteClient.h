@@ -63,22 +63,38 @@ namespace  DFHack
 
         static const char REQUEST_MAGIC[9];
         static const char RESPONSE_MAGIC[9];
+
+        // Version 2 adds compression of large messages
+        static const int CURRENT_VERSION = 2;
     };
 
     struct RPCMessageHeader {
         static const int MAX_MESSAGE_SIZE = 8*1048576;
 
+        static const int32_t COMPRESSED_FLAG = 0x40000000;
+        static const int COMPRESS_THRESHOLD = 4096;
+
         int16_t id;
         int32_t size;
     };
 
+    struct RPCTransportStats {
+        // Payload bytes before compression, and as sent over the wire
+        uint64_t raw_sent, wire_sent;
+        uint64_t raw_received, wire_received;
+
+        RPCTransportStats()
+            : raw_sent(0), wire_sent(0), raw_received(0), wire_received(0) {}
+    };
+
     /* Protocol description:
      *
      * 1. Handshake
      *
      *   Client initiates connection by sending the handshake
      *   request header. The server responds with the response
-     *   magic. Currently both versions must be 1.
+     *   magic, and the lower of its own and the client version,
+     *   which is then used by both sides. Versions 1 and 2 exist.
      *
      * 2. Interaction
      *
@@ -90,6 +106,11 @@ namespace  DFHack
      *   NOTE: As a special exception, RPC_REPLY_FAIL uses the size
      *         field to hold the error code directly.
      *
+     *   In version 2, either side may compress messages with zlib.
+     *   Such messages have COMPRESSED_FLAG set in the size field,
+     *   and their data consists of the uncompressed size as int32,
+     *   followed by the deflated protobuf.
+     *
      *   Every callable function is assigned a non-negative id by
      *   the server. Id 0 is reserved for BindMethod, which can be
      *   used to request any other id by function name. Id 1 is
@@ -251,11 +272,17 @@ namespace  DFHack
         int suspend_game();
         int resume_game();
 
+        bool is_compressed() { return compress; }
+        const RPCTransportStats &transport_stats() { return stats; }
+
     private:
         bool active, delete_output;
         CActiveSocket *socket;
         color_ostream *p_default_output;
 
+        bool compress;
+        RPCTransportStats stats;
+
         RemoteFunction<dfproto::CoreBindRequest,dfproto::CoreBindReply> bind_call;
         RemoteFunction<dfproto::CoreRunCommandRequest> runcmd_call;
 
@@ -37,6 +37,7 @@ namespace  DFHack
     class Plugin;
     class CoreService;
     class ServerConnection;
+    class ServerReactor;
 
     class DFHACK_EXPORT RPCService;
 
@@ -208,6 +209,8 @@ namespace  DFHack
     };
 
     class ServerConnection {
+        friend class ServerReactor;
+
         class connection_ostream : public buffered_color_ostream {
             ServerConnection *owner;
 
@@ -222,6 +225,9 @@ namespace  DFHack
         CActiveSocket *socket;
         connection_ostream stream;
 
+        bool compress;
+        RPCTransportStats stats;
+
         std::vector<ServerFunctionBase*> functions;
 
         CoreService *core_service;
@@ -231,15 +237,22 @@ namespace  DFHack
         static void threadFn(void *);
         void threadFn();
 
+        bool handshake(color_ostream &out, RPCHandshakeHeader &header);
+        bool dispatch(color_ostream &out, RPCMessageHeader &header, std::vector<uint8_t> &buf);
+
     public:
-        ServerConnection(CActiveSocket *socket);
+        // If not threaded, the owner is expected to drive I/O via dispatch.
+        ServerConnection(CActiveSocket *socket, bool threaded = true);
         ~ServerConnection();
 
         ServerFunctionBase *findFunction(color_ostream &out, const std::string &plugin, const std::string &name);
+
+        const RPCTransportStats &transport_stats() { return stats; }
     };
 
     class ServerMain {
         CPassiveSocket *socket;
+        ServerReactor *reactor;
 
         tthread::thread *thread;
         static void threadFn(void *);
@@ -248,5 +261,9 @@ namespace  DFHack
         ~ServerMain();
 
         bool listen(int port);
+
+        // Configured via DFHACK_RPC_WORKERS and DFHACK_RPC_MAX_CLIENTS
+        static int GetWorkerCount();
+        static int GetMaxClients();
     };
 }
@@ -337,10 +337,39 @@ end
 local internal = dfhack.internal
 
 internal.scripts = internal.scripts or {}
+internal.script_chunks = internal.script_chunks or {}
+
+if internal.script_cache == nil then
+    internal.script_cache = true
+end
 
 local scripts = internal.scripts
+local script_chunks = internal.script_chunks
 local hack_path = dfhack.getHackPath()
 
+-- Compiled chunks are reused while the file modification time and size match
+local function load_script_chunk(file, env)
+    local mtime, size
+    if internal.script_cache then
+        mtime, size = internal.getFileMTime(file)
+        local entry = script_chunks[file]
+        if entry and entry.env == env and entry.mtime == mtime and entry.size == size then
+            return entry.chunk
+        end
+    end
+    script_chunks[file] = nil
+
+    local f,perr = loadfile(file, 't', env)
+    if f == nil then
+        error(perr)
+    end
+
+    if mtime then
+        script_chunks[file] = { env = env, mtime = mtime, size = size, chunk = f }
+    end
+    return f
+end
+
 function dfhack.run_script(name,...)
     local key = string.lower(name)
     local file = hack_path..'scripts/'..name..'.lua'
@@ -349,10 +378,7 @@ function dfhack.run_script(name,...)
         env = {}
         setmetatable(env, { __index = base_env })
     end
-    local f,perr = loadfile(file, 't', env)
-    if f == nil then
-        error(perr)
-    end
+    local f = load_script_chunk(file, env)
     scripts[key] = env
     return f(...)
 end
@@ -524,6 +524,8 @@ bool dfhack_lua_viewscreen::safe_call_lua(int (*pf)(lua_State *), int args, int
     CoreSuspendClaimer suspend;
     color_ostream_proxy out(Core::getInstance().getConsole());
 
+    Lua::ProfileScope scope("screen", focus);
+
     auto L = Lua::Core::State;
     lua_pushcfunction(L, pf);
     if (args > 0) lua_insert(L, -args-1);
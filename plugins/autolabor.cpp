@@ -8,7 +8,10 @@
 
 #include <vector>
 #include <algorithm>
+#include <map>
+#include <set>
 
+#include "modules/EventManager.h"
 #include "modules/Units.h"
 #include "modules/World.h"
 
@@ -83,6 +86,10 @@ static bool print_debug = 0;
 
 static std::vector<int> state_count(5);
 
+// Duration of the last labor assignment cycle, shown by 'autolabor status'
+static uint64_t last_cycle_us = 0;
+static int last_cycle_dwarfs = 0;
+
 static PersistentDataItem config;
 
 enum ConfigFlags {
@@ -534,10 +541,76 @@ static void setOptionEnabled(ConfigFlags flag, bool on)
         config.ival(0) &= ~flag;
 }
 
+/*
+ * Change detection: the labor pass only runs when one of its inputs changed
+ * since the previous pass - the set of managed dwarfs, the state, noble
+ * position or meeting status of a dwarf, the workshop and depot flags, or
+ * the configuration. Skills and happiness are not tracked, so every
+ * FULL_PASS_INTERVAL checks the caches are dropped and a pass is forced.
+ */
+static const int FULL_PASS_INTERVAL = 10;
+
+static bool labors_dirty = true;
+static int checks_since_pass = 0;
+
+// Building-derived flags, rescanned only after BUILDING events
+static bool buildings_dirty = true;
+static bool has_butchers = false;
+static bool has_fishery = false;
+static std::vector<int32_t> depot_ids;
+static bool last_trader_requested = false;
+
+struct dwarf_cache_t
+{
+    bool valid;
+
+    // inputs and result of the state computation
+    int32_t job_id;
+    int job_type;
+    int profession;
+    int32_t squad_id;
+    size_t misc_traits;
+    size_t specific_refs;
+    dwarf_state state;
+
+    // inputs and results of the noble computation
+    int32_t hist_figure_id;
+    size_t entity_links;
+    int noble_penalty;
+    bool medical;
+    bool trader;
+
+    bool diplomacy;
+};
+
+static std::map<int32_t, dwarf_cache_t> dwarf_cache;
+static std::vector<int32_t> last_dwarf_ids;
+
+static void clear_change_tracking()
+{
+    labors_dirty = true;
+    checks_since_pass = 0;
+    buildings_dirty = true;
+    has_butchers = has_fishery = false;
+    depot_ids.clear();
+    last_trader_requested = false;
+    dwarf_cache.clear();
+    last_dwarf_ids.clear();
+}
+
+static void onBuildingChange(color_ostream &out, void *ptr)
+{
+    buildings_dirty = true;
+}
+
+static EventManager::EventHandler building_handler(onBuildingChange, 60);
+
 static void cleanup_state()
 {
     enable_autolabor = false;
     labor_infos.clear();
+    EventManager::unregisterAll(plugin_self);
+    clear_change_tracking();
 }
 
 static void reset_labor(df::unit_labor labor)
@@ -603,6 +676,7 @@ static void init_state()
 
     generate_labor_to_skill_map();
 
+    EventManager::registerListener(EventManager::EventType::BUILDING, building_handler, plugin_self);
 }
 
 static df::job_skill labor_to_skill[ENUM_LAST_ITEM(unit_labor) + 1];
@@ -730,15 +804,99 @@ struct laborinfo_sorter
 
 struct values_sorter
 {
-    values_sorter(std::vector <int> & values):values(values){};
+    values_sorter(const int *values):values(values){};
     bool operator() (int i,int j)
     {
         return values[i] > values[j];
     };
-    std::vector<int> & values;
+    const int *values;
 };
 
 
+/*
+ * Skill ratings and experience of all dwarfs, filled once per cycle from
+ * the skill vectors. Rows are indexed by skill, so that scoring a labor
+ * reads one contiguous row per array.
+ */
+struct skill_matrix_t
+{
+    int n_dwarfs;
+    std::vector<int> rating;
+    std::vector<int> experience;
+
+    void init(int n)
+    {
+        n_dwarfs = n;
+        rating.assign(n * (ENUM_LAST_ITEM(job_skill) + 1), 0);
+        experience.assign(rating.size(), 0);
+    }
+
+    void set(int dwarf, df::job_skill skill, int level, int exp)
+    {
+        if (skill < 0 || skill > ENUM_LAST_ITEM(job_skill))
+            return;
+        rating[skill * n_dwarfs + dwarf] = level;
+        experience[skill * n_dwarfs + dwarf] = exp;
+    }
+
+    const int *rating_row(df::job_skill skill) { return &rating[skill * n_dwarfs]; }
+    const int *experience_row(df::job_skill skill) { return &experience[skill * n_dwarfs]; }
+};
+
+/*
+ * Computes the preference value of every dwarf for every automatic labor,
+ * stored in rows of n_dwarfs values indexed by labor.
+ */
+static void score_labors(std::vector<int> &labor_values,
+    int n_dwarfs,
+    std::vector<dwarf_info_t>& dwarf_info,
+    std::vector<df::unit *>& dwarfs,
+    skill_matrix_t &skills)
+{
+    labor_values.assign((ENUM_LAST_ITEM(unit_labor) + 1) * n_dwarfs, 0);
+
+    std::vector<int> base_values(n_dwarfs);
+    for (int dwarf = 0; dwarf < n_dwarfs; dwarf++)
+        base_values[dwarf] = dwarf_info[dwarf].mastery_penalty + dwarfs[dwarf]->status.happiness;
+
+    FOR_ENUM_ITEMS(unit_labor, labor)
+    {
+        if (labor == unit_labor::NONE || labor_infos[labor].mode() != AUTOMATIC)
+            continue;
+
+        int *values = &labor_values[labor * n_dwarfs];
+        int enabled_bonus = labor_infos[labor].is_exclusive ? 355 : 5;
+
+        for (int dwarf = 0; dwarf < n_dwarfs; dwarf++)
+        {
+            values[dwarf] = base_values[dwarf];
+            if (dwarfs[dwarf]->status.labors[labor])
+                values[dwarf] += enabled_bonus;
+        }
+
+        df::job_skill skill = labor_to_skill[labor];
+        if (skill == job_skill::NONE)
+            continue;
+
+        const int *rating = skills.rating_row(skill);
+        const int *experience = skills.experience_row(skill);
+
+        for (int dwarf = 0; dwarf < n_dwarfs; dwarf++)
+        {
+            int skill_level = rating[dwarf];
+            int skill_experience = experience[dwarf];
+
+            int value = skill_level * 100 + skill_experience / 20;
+            if (skill_level > 0 || skill_experience > 0)
+                value += 200;
+            if (skill_level >= 15)
+                value += 1000 * (skill_level - 14);
+
+            values[dwarf] += value;
+        }
+    }
+}
+
 static void assign_labor(unit_labor::unit_labor labor,
     int n_dwarfs,
     std::vector<dwarf_info_t>& dwarf_info,
@@ -746,6 +904,8 @@ static void assign_labor(unit_labor::unit_labor labor,
     std::vector<df::unit *>& dwarfs,
     bool has_butchers,
     bool has_fishery,
+    std::vector<int>& labor_values,
+    skill_matrix_t &skills,
     color_ostream& out)
 {
     df::job_skill skill = labor_to_skill[labor];
@@ -753,17 +913,13 @@ static void assign_labor(unit_labor::unit_labor labor,
         if (labor_infos[labor].mode() != AUTOMATIC)
             return;
 
-        int best_dwarf = 0;
-        int best_value = -10000;
+        const int *values = &labor_values[labor * n_dwarfs];
+        const int *dwarf_skill = (skill != job_skill::NONE) ? skills.rating_row(skill) : NULL;
 
-        std::vector<int> values(n_dwarfs);
         std::vector<int> candidates;
-        std::map<int, int> dwarf_skill;
         std::vector<bool> previously_enabled(n_dwarfs);
 
-        auto mode = labor_infos[labor].mode();
-
-        // Find candidate dwarfs, and calculate a preference value for each dwarf
+        // Find candidate dwarfs; their preference values are computed by score_labors
         for (int dwarf = 0; dwarf < n_dwarfs; dwarf++)
         {
             if (dwarf_info[dwarf].state == CHILD)
@@ -778,52 +934,7 @@ static void assign_labor(unit_labor::unit_labor labor,
             if (labor_infos[labor].is_exclusive && dwarf_info[dwarf].has_exclusive_labor)
                 continue;
 
-            int value = dwarf_info[dwarf].mastery_penalty;
-
-            if (skill != job_skill::NONE)
-            {
-                int skill_level = 0;
-                int skill_experience = 0;
-
-                for (auto s = dwarfs[dwarf]->status.souls[0]->skills.begin(); s < dwarfs[dwarf]->status.souls[0]->skills.end(); s++)
-                {
-                    if ((*s)->id == skill)
-                    {
-                        skill_level = (*s)->rating;
-                        skill_experience = (*s)->experience;
-                        break;
-                    }
-                }
-
-                dwarf_skill[dwarf] = skill_level;
-
-                value += skill_level * 100;
-                value += skill_experience / 20;
-                if (skill_level > 0 || skill_experience > 0)
-                    value += 200;
-                if (skill_level >= 15)
-                    value += 1000 * (skill_level - 14);
-            }
-            else
-            {
-                dwarf_skill[dwarf] = 0;
-            }
-
-            if (dwarfs[dwarf]->status.labors[labor])
-            {
-                value += 5;
-                if (labor_infos[labor].is_exclusive)
-                    value += 350;
-            }
-
-            // bias by happiness
-
-            value += dwarfs[dwarf]->status.happiness;
-
-            values[dwarf] = value;
-
             candidates.push_back(dwarf);
-
         }
 
         // Sort candidates by preference value
@@ -875,7 +986,7 @@ static void assign_labor(unit_labor::unit_labor labor,
             bool preferred_dwarf = false;
             if (want_idle_dwarf && dwarf_info[dwarf].state == IDLE)
                 preferred_dwarf = true;
-            if (dwarf_skill[dwarf] > 0)
+            if (dwarf_skill && dwarf_skill[dwarf] > 0)
                 preferred_dwarf = true;
             if (previously_enabled[dwarf] && labor_infos[labor].is_exclusive)
                 preferred_dwarf = true;
@@ -913,6 +1024,200 @@ static void assign_labor(unit_labor::unit_labor labor,
 }
 
 
+static void scan_buildings()
+{
+    has_butchers = false;
+    has_fishery = false;
+    depot_ids.clear();
+
+    for (int i = 0; i < world->buildings.all.size(); ++i)
+    {
+        df::building *build = world->buildings.all[i];
+        auto type = build->getType();
+        if (building_type::Workshop == type)
+        {
+            df::workshop_type subType = (df::workshop_type)build->getSubtype();
+            if (workshop_type::Butchers == subType)
+                has_butchers = true;
+            if (workshop_type::Fishery == subType)
+                has_fishery = true;
+        }
+        else if (building_type::TradeDepot == type)
+            depot_ids.push_back(build->id);
+    }
+
+    buildings_dirty = false;
+}
+
+static bool check_trader_requested(color_ostream &out)
+{
+    bool trader_requested = false;
+
+    // The flag is toggled from the depot screen without a building event,
+    // so it is read from the known depots on every check.
+    for (size_t i = 0; i < depot_ids.size(); ++i)
+    {
+        auto depot = virtual_cast<df::building_tradedepotst>(df::building::find(depot_ids[i]));
+        if (!depot)
+            continue;
+
+        trader_requested = trader_requested || depot->trade_flags.bits.trader_requested;
+        if (print_debug)
+        {
+            if (trader_requested)
+                out.print("Trade depot found and trader requested, trader will be excluded from all labors.\n");
+            else
+                out.print("Trade depot found but trader is not requested.\n");
+        }
+    }
+
+    return trader_requested;
+}
+
+static void compute_noble_info(dwarf_cache_t &entry, df::historical_figure *hf)
+{
+    entry.noble_penalty = 0;
+    entry.medical = false;
+    entry.trader = false;
+
+    if (!hf) //can be NULL. E.g. script created citizens
+        return;
+
+    for (int i = 0; i < hf->entity_links.size(); i++)
+    {
+        df::histfig_entity_link* hfelink = hf->entity_links.at(i);
+        if (hfelink->getType() == df::histfig_entity_link_type::POSITION)
+        {
+            df::histfig_entity_link_positionst *epos =
+                (df::histfig_entity_link_positionst*) hfelink;
+            df::historical_entity* entity = df::historical_entity::find(epos->entity_id);
+            if (!entity)
+                continue;
+            df::entity_position_assignment* assignment = binsearch_in_vector(entity->positions.assignments, epos->assignment_id);
+            if (!assignment)
+                continue;
+            df::entity_position* position = binsearch_in_vector(entity->positions.own, assignment->position_id);
+            if (!position)
+                continue;
+
+            for (int n = 0; n < 25; n++)
+                if (position->responsibilities[n])
+                    entry.noble_penalty += responsibility_penalties[n];
+
+            if (position->responsibilities[df::entity_position_responsibility::HEALTH_MANAGEMENT])
+                entry.medical = true;
+
+            if (position->responsibilities[df::entity_position_responsibility::TRADE])
+                entry.trader = true;
+        }
+    }
+}
+
+// Find the activity state for a dwarf. It's important to get this right - a dwarf who we think is IDLE but
+// can't work will gum everything up. In the future I might add code to auto-detect slacker dwarves.
+
+static dwarf_state compute_dwarf_state(color_ostream &out, int dwarf, df::unit *unit)
+{
+    bool is_on_break = false;
+
+    for (auto p = unit->status.misc_traits.begin(); p < unit->status.misc_traits.end(); p++)
+    {
+        if ((*p)->id == misc_trait_type::Migrant || (*p)->id == misc_trait_type::OnBreak)
+            is_on_break = true;
+    }
+
+    if (unit->profession == profession::BABY ||
+        unit->profession == profession::CHILD ||
+        unit->profession == profession::DRUNK)
+    {
+        return CHILD;
+    }
+    else if (ENUM_ATTR(profession, military, unit->profession))
+        return MILITARY;
+    else if (unit->job.current_job == NULL)
+    {
+        if (is_on_break)
+            return OTHER;
+        else if (unit->specific_refs.size() > 0)
+            return OTHER;
+        else
+            return IDLE;
+    }
+    else
+    {
+        int job = unit->job.current_job->job_type;
+        if (job >= 0 && job < ARRAY_COUNT(dwarf_states))
+            return dwarf_states[job];
+
+        out.print("Dwarf %i \"%s\" has unknown job %i\n", dwarf, unit->name.first_name.c_str(), job);
+        return OTHER;
+    }
+}
+
+// Refreshes the cached inputs of a dwarf, recomputing only the parts whose
+// source fields changed. Returns true if anything the labor pass uses changed.
+
+static bool update_dwarf_cache(color_ostream &out, int dwarf, df::unit *unit, bool in_meeting)
+{
+    dwarf_cache_t &entry = dwarf_cache[unit->id];
+    bool changed = !entry.valid;
+
+    df::job *job = unit->job.current_job;
+    int32_t job_id = job ? job->id : -1;
+    int job_type = job ? (int)job->job_type : -1;
+
+    if (!entry.valid ||
+        entry.job_id != job_id ||
+        entry.job_type != job_type ||
+        entry.profession != unit->profession ||
+        entry.squad_id != unit->military.squad_id ||
+        entry.misc_traits != unit->status.misc_traits.size() ||
+        entry.specific_refs != unit->specific_refs.size())
+    {
+        entry.job_id = job_id;
+        entry.job_type = job_type;
+        entry.profession = unit->profession;
+        entry.squad_id = unit->military.squad_id;
+        entry.misc_traits = unit->status.misc_traits.size();
+        entry.specific_refs = unit->specific_refs.size();
+
+        dwarf_state state = compute_dwarf_state(out, dwarf, unit);
+        if (state != entry.state)
+            changed = true;
+        entry.state = state;
+    }
+
+    df::historical_figure* hf = df::historical_figure::find(unit->hist_figure_id);
+    size_t entity_links = hf ? hf->entity_links.size() : 0;
+
+    if (!entry.valid ||
+        entry.hist_figure_id != unit->hist_figure_id ||
+        entry.entity_links != entity_links)
+    {
+        int old_penalty = entry.noble_penalty;
+        bool old_medical = entry.medical;
+        bool old_trader = entry.trader;
+
+        entry.hist_figure_id = unit->hist_figure_id;
+        entry.entity_links = entity_links;
+        compute_noble_info(entry, hf);
+
+        if (entry.noble_penalty != old_penalty ||
+            entry.medical != old_medical ||
+            entry.trader != old_trader)
+            changed = true;
+    }
+
+    if (entry.diplomacy != in_meeting)
+    {
+        entry.diplomacy = in_meeting;
+        changed = true;
+    }
+
+    entry.valid = true;
+    return changed;
+}
+
 DFhackCExport command_result plugin_onstatechange(color_ostream &out, state_change_event event)
 {
     switch (event) {
@@ -949,36 +1254,21 @@ DFhackCExport command_result plugin_onupdate ( color_ostream &out )
 
     std::vector<df::unit *> dwarfs;
 
-    bool has_butchers = false;
-    bool has_fishery = false;
-    bool trader_requested = false;
+    if (buildings_dirty)
+    {
+        scan_buildings();
+        labors_dirty = true;
+    }
 
-    for (int i = 0; i < world->buildings.all.size(); ++i)
+    bool trader_requested = check_trader_requested(out);
+    if (trader_requested != last_trader_requested)
     {
-        df::building *build = world->buildings.all[i];
-        auto type = build->getType();
-        if (building_type::Workshop == type)
-        {
-            df::workshop_type subType = (df::workshop_type)build->getSubtype();
-            if (workshop_type::Butchers == subType)
-                has_butchers = true;
-            if (workshop_type::Fishery == subType)
-                has_fishery = true;
-        }
-        else if (building_type::TradeDepot == type)
-        {
-            df::building_tradedepotst* depot = (df::building_tradedepotst*) build;
-            trader_requested = trader_requested || depot->trade_flags.bits.trader_requested;
-            if (print_debug)
-            {
-                if (trader_requested)
-                    out.print("Trade depot found and trader requested, trader will be excluded from all labors.\n");
-                else
-                    out.print("Trade depot found but trader is not requested.\n");
-            }
-        }
+        last_trader_requested = trader_requested;
+        labors_dirty = true;
     }
 
+    std::vector<int32_t> dwarf_ids;
+
     for (int i = 0; i < world->units.active.size(); ++i)
     {
         df::unit* cre = world->units.active[i];
@@ -987,7 +1277,24 @@ DFhackCExport command_result plugin_onupdate ( color_ostream &out )
             if (cre->burrows.size() > 0)
                 continue;        // dwarfs assigned to burrows are skipped entirely
             dwarfs.push_back(cre);
+            dwarf_ids.push_back(cre->id);
+        }
+    }
+
+    if (dwarf_ids != last_dwarf_ids)
+    {
+        // forget dwarfs that died, left or were put in a burrow
+        std::set<int32_t> id_set(dwarf_ids.begin(), dwarf_ids.end());
+        for (auto it = dwarf_cache.begin(); it != dwarf_cache.end(); )
+        {
+            if (id_set.count(it->first))
+                ++it;
+            else
+                dwarf_cache.erase(it++);
         }
+
+        last_dwarf_ids.swap(dwarf_ids);
+        labors_dirty = true;
     }
 
     int n_dwarfs = dwarfs.size();
@@ -995,73 +1302,67 @@ DFhackCExport command_result plugin_onupdate ( color_ostream &out )
     if (n_dwarfs == 0)
         return CR_OK;
 
-    std::vector<dwarf_info_t> dwarf_info(n_dwarfs);
+    if (++checks_since_pass >= FULL_PASS_INTERVAL)
+    {
+        for (auto it = dwarf_cache.begin(); it != dwarf_cache.end(); ++it)
+            it->second.valid = false;
+        labors_dirty = true;
+    }
 
-    // Find total skill and highest skill for each dwarf. More skilled dwarves shouldn't be used for minor tasks.
+    // identify dwarfs who are needed for meetings and mark them for exclusion
 
-    for (int dwarf = 0; dwarf < n_dwarfs; dwarf++)
+    std::set<df::unit*> in_meeting;
+    for (int i = 0; i < ui->activities.size(); ++i)
     {
-        dwarf_info[dwarf].single_labor = -1;
+        df::activity_info *act = ui->activities[i];
+        if (!act) continue;
+        in_meeting.insert(act->person1);
+        in_meeting.insert(act->person2);
+    }
 
-        if (dwarfs[dwarf]->status.souls.size() <= 0)
-            continue;
+    state_count.clear();
+    state_count.resize(NUM_STATE);
 
-        // compute noble penalty
+    for (int dwarf = 0; dwarf < n_dwarfs; dwarf++)
+    {
+        if (update_dwarf_cache(out, dwarf, dwarfs[dwarf], in_meeting.count(dwarfs[dwarf]) != 0))
+            labors_dirty = true;
 
-        int noble_penalty = 0;
+        state_count[dwarf_cache[dwarfs[dwarf]->id].state]++;
+    }
 
-        df::historical_figure* hf = df::historical_figure::find(dwarfs[dwarf]->hist_figure_id);
-        if(hf!=NULL) //can be NULL. E.g. script created citizens
-        for (int i = 0; i < hf->entity_links.size(); i++)
-        {
-            df::histfig_entity_link* hfelink = hf->entity_links.at(i);
-            if (hfelink->getType() == df::histfig_entity_link_type::POSITION)
-            {
-                df::histfig_entity_link_positionst *epos =
-                    (df::histfig_entity_link_positionst*) hfelink;
-                df::historical_entity* entity = df::historical_entity::find(epos->entity_id);
-                if (!entity)
-                    continue;
-                df::entity_position_assignment* assignment = binsearch_in_vector(entity->positions.assignments, epos->assignment_id);
-                if (!assignment)
-                    continue;
-                df::entity_position* position = binsearch_in_vector(entity->positions.own, assignment->position_id);
-                if (!position)
-                    continue;
+    if (!labors_dirty && !print_debug)
+        return CR_OK;
 
-                for (int n = 0; n < 25; n++)
-                    if (position->responsibilities[n])
-                        noble_penalty += responsibility_penalties[n];
+    labors_dirty = false;
+    checks_since_pass = 0;
 
-                if (position->responsibilities[df::entity_position_responsibility::HEALTH_MANAGEMENT])
-                    dwarf_info[dwarf].medical = true;
+    uint64_t start_time = GetTimeUs64();
 
-                if (position->responsibilities[df::entity_position_responsibility::TRADE])
-                    dwarf_info[dwarf].trader = true;
+    std::vector<dwarf_info_t> dwarf_info(n_dwarfs);
 
-            }
+    static skill_matrix_t skills;
+    skills.init(n_dwarfs);
 
-        }
+    // Find total skill and highest skill for each dwarf. More skilled dwarves shouldn't be used for minor tasks.
 
-        dwarf_info[dwarf].noble_penalty = noble_penalty;
+    for (int dwarf = 0; dwarf < n_dwarfs; dwarf++)
+    {
+        const dwarf_cache_t &cached = dwarf_cache[dwarfs[dwarf]->id];
 
-        // identify dwarfs who are needed for meetings and mark them for exclusion
+        dwarf_info[dwarf].single_labor = -1;
+        dwarf_info[dwarf].state = cached.state;
 
-        for (int i = 0; i < ui->activities.size(); ++i)
-        {
-            df::activity_info *act = ui->activities[i];
-            if (!act) continue;
-            bool p1 = act->person1 == dwarfs[dwarf];
-            bool p2 = act->person2 == dwarfs[dwarf];
+        if (dwarfs[dwarf]->status.souls.size() <= 0)
+            continue;
 
-            if (p1 || p2)
-            {
-                dwarf_info[dwarf].diplomacy = true;
-                if (print_debug)
-                    out.print("Dwarf %i \"%s\" has a meeting, will be cleared of all labors\n", dwarf, dwarfs[dwarf]->name.first_name.c_str());
-                break;
-            }
-        }
+        dwarf_info[dwarf].noble_penalty = cached.noble_penalty;
+        dwarf_info[dwarf].medical = cached.medical;
+        dwarf_info[dwarf].trader = cached.trader;
+        dwarf_info[dwarf].diplomacy = cached.diplomacy;
+
+        if (cached.diplomacy && print_debug)
+            out.print("Dwarf %i \"%s\" has a meeting, will be cleared of all labors\n", dwarf, dwarfs[dwarf]->name.first_name.c_str());
 
         for (auto s = dwarfs[dwarf]->status.souls[0]->skills.begin(); s != dwarfs[dwarf]->status.souls[0]->skills.end(); s++)
         {
@@ -1072,6 +1373,8 @@ DFhackCExport command_result plugin_onupdate ( color_ostream &out )
             int skill_level = (*s)->rating;
             int skill_experience = (*s)->experience;
 
+            skills.set(dwarf, skill, skill_level, skill_experience);
+
             // Track total & highest skill among normal/medical skills. (We don't care about personal or social skills.)
 
             if (skill_class != job_skill_class::Normal && skill_class != job_skill_class::Medical)
@@ -1099,54 +1402,6 @@ DFhackCExport command_result plugin_onupdate ( color_ostream &out )
             if (labor_infos[labor].is_exclusive && dwarfs[dwarf]->status.labors[labor])
                 dwarf_info[dwarf].mastery_penalty -= 100;
         }
-    }
-
-    // Find the activity state for each dwarf. It's important to get this right - a dwarf who we think is IDLE but
-    // can't work will gum everything up. In the future I might add code to auto-detect slacker dwarves.
-
-    state_count.clear();
-    state_count.resize(NUM_STATE);
-
-    for (int dwarf = 0; dwarf < n_dwarfs; dwarf++)
-    {
-        bool is_on_break = false;
-
-        for (auto p = dwarfs[dwarf]->status.misc_traits.begin(); p < dwarfs[dwarf]->status.misc_traits.end(); p++)
-        {
-            if ((*p)->id == misc_trait_type::Migrant || (*p)->id == misc_trait_type::OnBreak)
-                is_on_break = true;
-        }
-
-        if (dwarfs[dwarf]->profession == profession::BABY ||
-            dwarfs[dwarf]->profession == profession::CHILD ||
-            dwarfs[dwarf]->profession == profession::DRUNK)
-        {
-            dwarf_info[dwarf].state = CHILD;
-        }
-        else if (ENUM_ATTR(profession, military, dwarfs[dwarf]->profession))
-            dwarf_info[dwarf].state = MILITARY;
-        else if (dwarfs[dwarf]->job.current_job == NULL)
-        {
-            if (is_on_break)
-                dwarf_info[dwarf].state = OTHER;
-            else if (dwarfs[dwarf]->specific_refs.size() > 0)
-                dwarf_info[dwarf].state = OTHER;
-            else
-                dwarf_info[dwarf].state = IDLE;
-        }
-        else
-        {
-            int job = dwarfs[dwarf]->job.current_job->job_type;
-            if (job >= 0 && job < ARRAY_COUNT(dwarf_states))
-                dwarf_info[dwarf].state = dwarf_states[job];
-            else
-            {
-                out.print("Dwarf %i \"%s\" has unknown job %i\n", dwarf, dwarfs[dwarf]->name.first_name.c_str(), job);
-                dwarf_info[dwarf].state = OTHER;
-            }
-        }
-
-        state_count[dwarf_info[dwarf].state]++;
 
         if (print_debug)
             out.print("Dwarf %i \"%s\": penalty %i, state %s\n", dwarf, dwarfs[dwarf]->name.first_name.c_str(), dwarf_info[dwarf].mastery_penalty, state_names[dwarf_info[dwarf].state]);
@@ -1194,11 +1449,14 @@ DFhackCExport command_result plugin_onupdate ( color_ostream &out )
 
     // Handle all skills except those marked HAULERS
 
+    static std::vector<int> labor_values;
+    score_labors(labor_values, n_dwarfs, dwarf_info, dwarfs, skills);
+
     for (auto lp = labors.begin(); lp != labors.end(); ++lp)
     {
         auto labor = *lp;
 
-        assign_labor(labor, n_dwarfs, dwarf_info, trader_requested, dwarfs, has_butchers, has_fishery, out);
+        assign_labor(labor, n_dwarfs, dwarf_info, trader_requested, dwarfs, has_butchers, has_fishery, labor_values, skills, out);
     }
 
     // Set about 1/3 of the dwarfs as haulers. The haulers have all HAULER labors enabled. Having a lot of haulers helps
@@ -1277,6 +1535,9 @@ DFhackCExport command_result plugin_onupdate ( color_ostream &out )
         }
     }
 
+    last_cycle_us = GetTimeUs64() - start_time;
+    last_cycle_dwarfs = n_dwarfs;
+
     print_debug = 0;
 
     return CR_OK;
@@ -1315,6 +1576,7 @@ DFhackCExport command_result plugin_enable ( color_ostream &out, bool enable )
     {
         enable_autolabor = false;
         setOptionEnabled(CF_ENABLED, false);
+        EventManager::unregisterAll(plugin_self);
 
         out << "Autolabor is disabled." << endl;
     }
@@ -1349,6 +1611,7 @@ command_result autolabor (color_ostream &out, std::vector <std::string> & parame
 
         int pct = atoi (parameters[1].c_str());
         hauler_pct = pct;
+        labors_dirty = true;
         return CR_OK;
     }
     else if (parameters.size() == 2 || parameters.size() == 3)
@@ -1359,6 +1622,8 @@ command_result autolabor (color_ostream &out, std::vector <std::string> & parame
             return CR_FAILURE;
         }
 
+        labors_dirty = true;
+
         df::unit_labor labor = unit_labor::NONE;
 
         FOR_ENUM_ITEMS(unit_labor, test_labor)
@@ -1422,6 +1687,7 @@ command_result autolabor (color_ostream &out, std::vector <std::string> & parame
         {
             reset_labor((df::unit_labor) i);
         }
+        labors_dirty = true;
         out << "All labors reset." << endl;
         return CR_OK;
     }
@@ -1445,6 +1711,9 @@ command_result autolabor (color_ostream &out, std::vector <std::string> & parame
         }
         out << endl;
 
+        out.print("Last assignment of %d dwarfs took %.2f ms.\n",
+                  last_cycle_dwarfs, last_cycle_us / 1000.0);
+
         if (parameters[0] == "list")
         {
             FOR_ENUM_ITEMS(unit_labor, labor)
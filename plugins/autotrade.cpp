@@ -17,6 +17,7 @@
 #include "df/caravan_state.h"
 #include "df/mandate.h"
 #include "modules/Maps.h"
+#include "df/map_block.h"
 #include "modules/World.h"
 
 using df::global::world;
@@ -74,17 +75,35 @@ public:
         id = config.ival(1);
     }
 
-    bool inStockpile(df::item *i)
+    // Collects the top-level items lying on the stockpile tiles. Instead of
+    // testing every item in the world against the pile, this walks the item
+    // lists of the map blocks the pile covers; the block/tile layout is only
+    // rebuilt when the pile extents change.
+    void getItems(vector<df::item*> *items)
     {
-        df::item *container = Items::getContainer(i);
-        if (container)
-            return inStockpile(container);
+        items->clear();
 
-        if (i->pos.z != z) return false;
-        if (i->pos.x < x1 || i->pos.x >= x2 ||
-            i->pos.y < y1 || i->pos.y >= y2) return false;
-        int e = (i->pos.x - x1) + (i->pos.y - y1) * sp->room.width;
-        return sp->room.extents[e] == 1;
+        if (layoutChanged())
+            indexTiles();
+
+        for (auto it = blocks.begin(); it != blocks.end(); it++)
+        {
+            df::map_block *block = it->block;
+            for (size_t i = 0; i < block->items.size(); i++)
+            {
+                df::item *item = df::item::find(block->items[i]);
+                if (!item || !item->flags.bits.on_ground || item->pos.z != z)
+                    continue;
+
+                int tx = item->pos.x - block->map_pos.x;
+                int ty = item->pos.y - block->map_pos.y;
+                if (tx < 0 || tx >= 16 || ty < 0 || ty >= 16)
+                    continue;
+
+                if (it->rows[ty] & (1 << tx))
+                    items->push_back(item);
+            }
+        }
     }
 
     bool isValid()
@@ -135,6 +154,65 @@ private:
     int x1, x2, y1, y2, z;
     int32_t id;
 
+    struct BlockTiles
+    {
+        df::map_block *block;
+        uint16_t rows[16];  // bit x of rows[y] is set for stockpile tiles
+    };
+
+    // Pile tiles grouped by map block, and the extents they were built from
+    vector<BlockTiles> blocks;
+    vector<uint8_t> indexed_extents;
+
+    bool layoutChanged()
+    {
+        size_t size = sp->room.width * sp->room.height;
+        if (sp->z != z || sp->room.x != x1 || sp->room.y != y1 ||
+            sp->room.x + sp->room.width != x2 || sp->room.y + sp->room.height != y2)
+        {
+            return true;
+        }
+
+        return indexed_extents.size() != size ||
+            (size && memcmp(&indexed_extents[0], sp->room.extents, size) != 0);
+    }
+
+    void indexTiles()
+    {
+        readBuilding();
+        blocks.clear();
+
+        size_t size = sp->room.width * sp->room.height;
+        indexed_extents.assign(sp->room.extents, sp->room.extents + size);
+
+        std::map<df::map_block*, size_t> block_slots;
+        for (int y = y1; y < y2; y++)
+        {
+            for (int x = x1; x < x2; x++)
+            {
+                int e = (x - x1) + (y - y1) * sp->room.width;
+                if (sp->room.extents[e] != 1)
+                    continue;
+
+                df::map_block *block = Maps::getTileBlock(x, y, z);
+                if (!block)
+                    continue;
+
+                auto slot = block_slots.find(block);
+                if (slot == block_slots.end())
+                {
+                    BlockTiles tiles;
+                    tiles.block = block;
+                    memset(tiles.rows, 0, sizeof(tiles.rows));
+                    slot = block_slots.insert(std::make_pair(block, blocks.size())).first;
+                    blocks.push_back(tiles);
+                }
+
+                blocks[slot->second].rows[y - block->map_pos.y] |= 1 << (x - block->map_pos.x);
+            }
+        }
+    }
+
     void readBuilding()
     {
         id = sp->id;
@@ -326,9 +404,6 @@ static void mark_all_in_stockpiles(vector<StockpileInfo> &stockpiles, bool annou
         return;
     }
 
-    std::vector<df::item*> &items = world->items.other[items_other_id::IN_PLAY];
-
-
     // Precompute a bitmask with the bad flags
     df::item_flags bad_flags;
     bad_flags.whole = 0;
@@ -342,23 +417,23 @@ static void mark_all_in_stockpiles(vector<StockpileInfo> &stockpiles, bool annou
 
     size_t marked_count = 0;
     size_t error_count = 0;
-    for (size_t i = 0; i < items.size(); i++)
+    vector<df::item*> items;
+    vector<df::item*> contained_items;
+    for (auto it = stockpiles.begin(); it != stockpiles.end(); it++)
     {
-        df::item *item = items[i];
-        if (item->flags.whole & bad_flags.whole)
-            continue;
+        it->getItems(&items);
 
-        if (!is_valid_item(item))
-            continue;
-
-        for (auto it = stockpiles.begin(); it != stockpiles.end(); it++)
+        for (size_t i = 0; i < items.size(); i++)
         {
-            if (!it->inStockpile(item))
+            df::item *item = items[i];
+            if (item->flags.whole & bad_flags.whole)
+                continue;
+
+            if (!is_valid_item(item))
                 continue;
 
             // In case of container, check contained items for mandates
             bool mandates_ok = true;
-            vector<df::item*> contained_items;
             Items::getContainedItems(item, &contained_items);
             for (auto cit = contained_items.begin(); cit != contained_items.end(); cit++)
             {
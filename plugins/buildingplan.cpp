@@ -1,6 +1,7 @@
 #include "uicommon.h"
 
 #include <functional>
+#include <unordered_map>
 
 // DF data structure definition headers
 #include "DataDefs.h"
@@ -152,6 +153,13 @@ struct ItemFilter
         return descriptions;
     }
 
+    // filters with the same key accept the same items
+    string getKey()
+    {
+        return getMaterialFilterAsSerial() + "/" + int_to_string(min_quality) +
+            (decorated_only ? "/d" : "");
+    }
+
     string getMaterialFilterAsSerial()
     {
         string str;
@@ -470,6 +478,140 @@ private:
 
 static void delete_item_fn(df::job_item *x) { delete x; }
 
+/*
+ * Spatial index over available items, used to find the item closest to a
+ * planned building without scanning every candidate. Items are bucketed
+ * into square cells per z-level; a query visits non-empty cells in order of
+ * the smallest distance any of their items could have, and stops once no
+ * remaining cell can beat the best item found. Removal is O(1).
+ */
+class ItemGrid
+{
+public:
+    void clear()
+    {
+        cells.clear();
+        cell_index.clear();
+        slots.clear();
+    }
+
+    size_t size() const
+    {
+        return slots.size();
+    }
+
+    void add(df::item *item)
+    {
+        if (slots.find(item->id) != slots.end())
+            return;
+
+        int32_t cx = cellCoord(item->pos.x), cy = cellCoord(item->pos.y);
+        int64_t key = (int64_t(item->pos.z) << 32) | (int64_t(uint16_t(cy)) << 16) | uint16_t(cx);
+
+        auto it = cell_index.find(key);
+        size_t cell;
+        if (it == cell_index.end())
+        {
+            cell = cells.size();
+            cell_index[key] = cell;
+
+            Cell new_cell;
+            new_cell.x = cx * CELL_SIZE;
+            new_cell.y = cy * CELL_SIZE;
+            new_cell.z = item->pos.z;
+            cells.push_back(new_cell);
+        }
+        else
+            cell = it->second;
+
+        slots[item->id] = make_pair(cell, cells[cell].items.size());
+        cells[cell].items.push_back(item);
+    }
+
+    bool remove(df::item *item)
+    {
+        auto it = slots.find(item->id);
+        if (it == slots.end())
+            return false;
+
+        auto &items = cells[it->second.first].items;
+        size_t slot = it->second.second;
+        if (slot + 1 < items.size())
+        {
+            items[slot] = items.back();
+            slots[items[slot]->id].second = slot;
+        }
+        items.pop_back();
+        slots.erase(it);
+        return true;
+    }
+
+    // distance used to rank items; a z-level counts as 50 tiles
+    static int32_t distance(const df::coord &a, const df::coord &b)
+    {
+        return abs(a.x - b.x) + abs(a.y - b.y) + abs(a.z - b.z) * 50;
+    }
+
+    df::item *findClosest(const df::coord &pos)
+    {
+        order.clear();
+        for (size_t i = 0; i < cells.size(); i++)
+        {
+            if (!cells[i].items.empty())
+                order.push_back(make_pair(cellDistance(cells[i], pos), i));
+        }
+        sort(order.begin(), order.end());
+
+        df::item *closest = nullptr;
+        int32_t closest_distance = -1;
+        for (auto cell = order.begin(); cell != order.end(); cell++)
+        {
+            if (closest && cell->first >= closest_distance)
+                break;
+
+            auto &items = cells[cell->second].items;
+            for (auto item = items.begin(); item != items.end(); item++)
+            {
+                int32_t d = distance((*item)->pos, pos);
+                if (closest && d >= closest_distance)
+                    continue;
+
+                closest = *item;
+                closest_distance = d;
+            }
+        }
+
+        return closest;
+    }
+
+private:
+    static const int32_t CELL_SIZE = 16;
+
+    struct Cell
+    {
+        int32_t x, y, z;
+        vector<df::item *> items;
+    };
+
+    vector<Cell> cells;
+    std::unordered_map<int64_t, size_t> cell_index;
+    std::unordered_map<int32_t, pair<size_t, size_t>> slots; // item id -> (cell, position in cell)
+    vector<pair<int32_t, size_t>> order;
+
+    static int32_t cellCoord(int32_t v)
+    {
+        return (v >= 0) ? v / CELL_SIZE : (v - CELL_SIZE + 1) / CELL_SIZE;
+    }
+
+    // lower bound of the distance from pos to any tile in the cell
+    static int32_t cellDistance(const Cell &cell, const df::coord &pos)
+    {
+        int32_t dx = std::max(0, std::max(cell.x - pos.x, pos.x - (cell.x + CELL_SIZE - 1)));
+        int32_t dy = std::max(0, std::max(cell.y - pos.y, pos.y - (cell.y + CELL_SIZE - 1)));
+        return dx + dy + abs(cell.z - pos.z) * 50;
+    }
+};
+
 // START Planning 
 class PlannedBuilding
 {
@@ -510,37 +652,17 @@ public:
         return building->getType();
     }
 
-    bool assignClosestItem(vector<df::item *> *items_vector)
+    df::item *assignClosestItem(ItemGrid *items)
     {
-        decltype(items_vector->begin()) closest_item;
-        int32_t closest_distance = -1;
-        for (auto item_iter = items_vector->begin(); item_iter != items_vector->end(); item_iter++)
-        {
-            auto item = *item_iter;
-            if (!filter.matches(item))
-                continue;
-
-            auto pos = item->pos;
-            auto distance = abs(pos.x - building->centerx) + 
-                abs(pos.y - building->centery) + 
-                abs(pos.z - building->z) * 50;
-
-            if (closest_distance > -1 && distance >= closest_distance)
-                continue;
-
-            closest_distance = distance;
-            closest_item = item_iter;
-        }
-
-        if (closest_distance > -1 && assignItem(*closest_item))
+        auto item = items->findClosest(df::coord(building->centerx, building->centery, building->z));
+        if (item && assignItem(item))
         {
             debug("Item assigned");
-            items_vector->erase(closest_item);
             remove();
-            return true;
+            return item;
         }
 
-        return false;
+        return nullptr;
     }
 
     bool assignItem(df::item *item)
@@ -722,13 +844,15 @@ public:
                     debug(string("Trying to allocate ") + enum_item_key_str(building_iter->getType()));
 
                 auto required_item_type = item_for_building_type[building_iter->getType()];
-                auto items_vector = &available_item_vectors[required_item_type];
-                if (items_vector->size() == 0 || !building_iter->assignClosestItem(items_vector))
+                auto items = getMatchingItems(required_item_type, building_iter->getFilter());
+                df::item *item = (items->size() == 0) ? nullptr : building_iter->assignClosestItem(items);
+                if (!item)
                 {
                     debug("Unable to allocate an item");
                     ++building_iter;
                     continue;
                 }
+                removeAvailableItem(required_item_type, item);
             }
             debug("Removing building plan");
             building_iter = planned_buildings.erase(building_iter);
@@ -832,8 +956,43 @@ private:
     map<df::item_type, bool> is_relevant_item_type; //Needed for fast check when looping over all items
     bool quickfort_mode;
 
+    // Per cycle: available items of each type that pass a filter, keyed by ItemFilter::getKey().
+    // Built on first use, so each filter is evaluated once per item instead of once per building.
+    map<df::item_type, map<string, ItemGrid>> matching_items;
+
     vector<PlannedBuilding> planned_buildings;
 
+    ItemGrid *getMatchingItems(df::item_type itype, ItemFilter *filter)
+    {
+        auto &grids = matching_items[itype];
+        string key = filter->getKey();
+
+        auto it = grids.find(key);
+        if (it != grids.end())
+            return &it->second;
+
+        ItemGrid &grid = grids[key];
+        auto &items = available_item_vectors[itype];
+        for (auto item = items.begin(); item != items.end(); item++)
+        {
+            // skip items already assigned earlier in this cycle
+            if ((*item)->flags.bits.in_job)
+                continue;
+
+            if (filter->matches(*item))
+                grid.add(*item);
+        }
+
+        return &grid;
+    }
+
+    void removeAvailableItem(df::item_type itype, df::item *item)
+    {
+        auto &grids = matching_items[itype];
+        for (auto grid = grids.begin(); grid != grids.end(); grid++)
+            grid->second.remove(item);
+    }
+
     void gather_available_items()
     {
         debug("Gather available items");
@@ -841,6 +1000,7 @@ private:
         {
             iter->second.clear();
         }
+        matching_items.clear();
 
         // Precompute a bitmask with the bad flags
         df::item_flags bad_flags;
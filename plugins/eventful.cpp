@@ -25,6 +25,7 @@
 #include "LuaTools.h"
 
 #include "modules/EventManager.h"
+#include "modules/Job.h"
 
 #include "df/job.h"
 #include "df/building.h"
@@ -131,6 +132,16 @@ DEFINE_LUA_EVENT_1(onConstructionCreatedDestroyed, handle_constructions, df::con
 DEFINE_LUA_EVENT_2(onSyndrome, handle_syndrome, int32_t,int32_t);
 DEFINE_LUA_EVENT_1(onInvasion,handle_int32t,int32_t);
 DEFINE_LUA_EVENT_4(onInventoryChange,handle_inventory_change,int32_t,int32_t,df::unit_inventory_item*,df::unit_inventory_item*);
+//batched event manager events: one call per update with an array of all events
+static Lua::Notification onBuildingCreatedDestroyedBatch_event;
+static Lua::Notification onJobInitiatedBatch_event;
+static Lua::Notification onJobCompletedBatch_event;
+static Lua::Notification onUnitDeathBatch_event;
+static Lua::Notification onItemCreatedBatch_event;
+static Lua::Notification onConstructionCreatedDestroyedBatch_event;
+static Lua::Notification onSyndromeBatch_event;
+static Lua::Notification onInvasionBatch_event;
+static Lua::Notification onInventoryChangeBatch_event;
 DFHACK_PLUGIN_LUA_EVENTS {
     DFHACK_LUA_EVENT(onWorkshopFillSidebarMenu),
     DFHACK_LUA_EVENT(postWorkshopFillSidebarMenu),
@@ -150,48 +161,103 @@ DFHACK_PLUGIN_LUA_EVENTS {
     DFHACK_LUA_EVENT(onSyndrome),
     DFHACK_LUA_EVENT(onInvasion),
     DFHACK_LUA_EVENT(onInventoryChange),
+    DFHACK_LUA_EVENT(onBuildingCreatedDestroyedBatch),
+    DFHACK_LUA_EVENT(onConstructionCreatedDestroyedBatch),
+    DFHACK_LUA_EVENT(onJobInitiatedBatch),
+    DFHACK_LUA_EVENT(onJobCompletedBatch),
+    DFHACK_LUA_EVENT(onUnitDeathBatch),
+    DFHACK_LUA_EVENT(onItemCreatedBatch),
+    DFHACK_LUA_EVENT(onSyndromeBatch),
+    DFHACK_LUA_EVENT(onInvasionBatch),
+    DFHACK_LUA_EVENT(onInventoryChangeBatch),
     DFHACK_LUA_END
 };
 
+/*
+ * Batches: events are collected only if the batched event has listeners,
+ * copying the data that does not outlive the handler call.
+ */
+struct InventoryChange {
+    int32_t unitId;
+    int32_t itemId;
+    bool has_old, has_new;
+    df::unit_inventory_item item_old;
+    df::unit_inventory_item item_new;
+};
+static bool batch_pending = false;
+static std::vector<df::job*> batch_jobs_initiated;
+static std::vector<df::job*> batch_jobs_completed;
+static std::vector<int32_t> batch_unit_deaths;
+static std::vector<int32_t> batch_items_created;
+static std::vector<int32_t> batch_buildings;
+static std::vector<df::construction> batch_constructions;
+static std::vector<EventManager::SyndromeData> batch_syndromes;
+static std::vector<int32_t> batch_invasions;
+static std::vector<InventoryChange> batch_inventory;
+
+template<class T>
+static void add_to_batch(Lua::Notification &event, std::vector<T> &batch, const T &value)
+{
+    if (!event.get_listener_count())
+        return;
+    batch.push_back(value);
+    batch_pending = true;
+}
+static void add_job_to_batch(Lua::Notification &event, std::vector<df::job*> &batch, df::job *job)
+{
+    if (!event.get_listener_count())
+        return;
+    batch.push_back(Job::cloneJobStruct(job, true));
+    batch_pending = true;
+}
+
 static void ev_mng_jobInitiated(color_ostream& out, void* job)
 {
     df::job* ptr=reinterpret_cast<df::job*>(job);
     onJobInitiated(out,ptr);
+    add_job_to_batch(onJobInitiatedBatch_event, batch_jobs_initiated, ptr);
 }
 void ev_mng_jobCompleted(color_ostream& out, void* job)
 {
     df::job* ptr=reinterpret_cast<df::job*>(job);
     onJobCompleted(out,ptr);
+    add_job_to_batch(onJobCompletedBatch_event, batch_jobs_completed, ptr);
 }
 void ev_mng_unitDeath(color_ostream& out, void* ptr)
 {
     int32_t myId=int32_t(ptr);
     onUnitDeath(out,myId);
+    add_to_batch(onUnitDeathBatch_event, batch_unit_deaths, myId);
 }
 void ev_mng_itemCreate(color_ostream& out, void* ptr)
 {
     int32_t myId=int32_t(ptr);
     onItemCreated(out,myId);
+    add_to_batch(onItemCreatedBatch_event, batch_items_created, myId);
 }
 void ev_mng_construction(color_ostream& out, void* ptr)
 {
     df::construction* cons=reinterpret_cast<df::construction*>(ptr);
     onConstructionCreatedDestroyed(out,cons);
+    add_to_batch(onConstructionCreatedDestroyedBatch_event, batch_constructions, *cons);
 }
 void ev_mng_syndrome(color_ostream& out, void* ptr)
 {
     EventManager::SyndromeData* data=reinterpret_cast<EventManager::SyndromeData*>(ptr);
     onSyndrome(out,data->unitId,data->syndromeIndex);
+    add_to_batch(onSyndromeBatch_event, batch_syndromes, *data);
 }
 void ev_mng_invasion(color_ostream& out, void* ptr)
 {
     int32_t myId=int32_t(ptr);
     onInvasion(out,myId);
+    add_to_batch(onInvasionBatch_event, batch_invasions, myId);
 }
 static void ev_mng_building(color_ostream& out, void* ptr)
 {
     int32_t myId=int32_t(ptr);
     onBuildingCreatedDestroyed(out,myId);
+    add_to_batch(onBuildingCreatedDestroyedBatch_event, batch_buildings, myId);
 }
 static void ev_mng_inventory(color_ostream& out, void* ptr)
 {
@@ -209,6 +275,118 @@ static void ev_mng_inventory(color_ostream& out, void* ptr)
         item_new = &data->item_new->item;
     }
     onInventoryChange(out,unitId,itemId,item_old,item_new);
+
+    if (onInventoryChangeBatch_event.get_listener_count()) {
+        InventoryChange change;
+        change.unitId = unitId;
+        change.itemId = itemId;
+        change.has_old = (item_old != NULL);
+        change.has_new = (item_new != NULL);
+        if (item_old)
+            change.item_old = *item_old;
+        if (item_new)
+            change.item_new = *item_new;
+        add_to_batch(onInventoryChangeBatch_event, batch_inventory, change);
+    }
+}
+
+template<class T>
+static void flush_batch(color_ostream &out, Lua::Notification &event, std::vector<T> &batch)
+{
+    if (batch.empty())
+        return;
+    if (auto state = event.state_if_count()) {
+        Lua::PushVector(state, batch);
+        event.invoke(out, 1);
+    }
+    batch.clear();
+}
+static void flush_job_batch(color_ostream &out, Lua::Notification &event, std::vector<df::job*> &batch)
+{
+    if (batch.empty())
+        return;
+    if (auto state = event.state_if_count()) {
+        Lua::PushVector(state, batch);
+        event.invoke(out, 1);
+    }
+    for (size_t i = 0; i < batch.size(); i++)
+        Job::deleteJobStruct(batch[i], true);
+    batch.clear();
+}
+static void flush_construction_batch(color_ostream &out)
+{
+    std::vector<df::construction*> ptrs;
+    for (size_t i = 0; i < batch_constructions.size(); i++)
+        ptrs.push_back(&batch_constructions[i]);
+    flush_batch(out, onConstructionCreatedDestroyedBatch_event, ptrs);
+    batch_constructions.clear();
+}
+static void flush_syndrome_batch(color_ostream &out)
+{
+    if (batch_syndromes.empty())
+        return;
+    if (auto state = onSyndromeBatch_event.state_if_count()) {
+        lua_createtable(state, batch_syndromes.size(), 0);
+        for (size_t i = 0; i < batch_syndromes.size(); i++) {
+            lua_createtable(state, 0, 2);
+            Lua::SetField(state, batch_syndromes[i].unitId, -1, "unit_id");
+            Lua::SetField(state, batch_syndromes[i].syndromeIndex, -1, "syndrome_index");
+            lua_rawseti(state, -2, i+1);
+        }
+        onSyndromeBatch_event.invoke(out, 1);
+    }
+    batch_syndromes.clear();
+}
+static void flush_inventory_batch(color_ostream &out)
+{
+    if (batch_inventory.empty())
+        return;
+    if (auto state = onInventoryChangeBatch_event.state_if_count()) {
+        lua_createtable(state, batch_inventory.size(), 0);
+        for (size_t i = 0; i < batch_inventory.size(); i++) {
+            InventoryChange &change = batch_inventory[i];
+            lua_createtable(state, 0, 4);
+            Lua::SetField(state, change.unitId, -1, "unit_id");
+            Lua::SetField(state, change.itemId, -1, "item_id");
+            if (change.has_old)
+                Lua::SetField(state, &change.item_old, -1, "item_old");
+            if (change.has_new)
+                Lua::SetField(state, &change.item_new, -1, "item_new");
+            lua_rawseti(state, -2, i+1);
+        }
+        onInventoryChangeBatch_event.invoke(out, 1);
+    }
+    batch_inventory.clear();
+}
+static void flush_batches(color_ostream &out)
+{
+    batch_pending = false;
+    flush_job_batch(out, onJobInitiatedBatch_event, batch_jobs_initiated);
+    flush_job_batch(out, onJobCompletedBatch_event, batch_jobs_completed);
+    flush_batch(out, onUnitDeathBatch_event, batch_unit_deaths);
+    flush_batch(out, onItemCreatedBatch_event, batch_items_created);
+    flush_batch(out, onBuildingCreatedDestroyedBatch_event, batch_buildings);
+    flush_construction_batch(out);
+    flush_syndrome_batch(out);
+    flush_batch(out, onInvasionBatch_event, batch_invasions);
+    flush_inventory_batch(out);
+}
+static void clear_batches()
+{
+    batch_pending = false;
+    for (size_t i = 0; i < batch_jobs_initiated.size(); i++)
+        Job::deleteJobStruct(batch_jobs_initiated[i], true);
+    for (size_t i = 0; i < batch_jobs_completed.size(); i++)
+        Job::deleteJobStruct(batch_jobs_completed[i], true);
+    batch_jobs_initiated.clear();
+    batch_jobs_completed.clear();
+    batch_unit_deaths.clear();
+    batch_items_created.clear();
+    batch_buildings.clear();
+    batch_constructions.clear();
+    batch_syndromes.clear();
+    batch_invasions.clear();
+    batch_inventory.clear();
 }
 std::vector<int> enabledEventManagerEvents(EventManager::EventType::EVENT_MAX,-1);
 typedef void (*handler_t) (color_ostream&,void*);
@@ -427,8 +605,12 @@ DFhackCExport command_result plugin_onstatechange(color_ostream &out, state_chan
     case SC_WORLD_LOADED:
         world_specific_hooks(out,true);
         break;
+    case SC_MAP_UNLOADED:
+        clear_batches();
+        break;
     case SC_WORLD_UNLOADED:
         world_specific_hooks(out,false);
+        clear_batches();
         
         break;
     default:
@@ -438,6 +620,13 @@ DFhackCExport command_result plugin_onstatechange(color_ostream &out, state_chan
     return CR_OK;
 }
 
+DFhackCExport command_result plugin_onupdate(color_ostream &out)
+{
+    if (batch_pending)
+        flush_batches(out);
+    return CR_OK;
+}
+
 DFhackCExport command_result plugin_init ( color_ostream &out, std::vector <PluginCommand> &commands)
 {
     if (Core::getInstance().isWorldLoaded())
@@ -449,5 +638,6 @@ DFhackCExport command_result plugin_init ( color_ostream &out, std::vector <Plug
 DFhackCExport command_result plugin_shutdown ( color_ostream &out )
 {
     disable_all_hooks(out);
+    clear_batches();
     return CR_OK;
 }
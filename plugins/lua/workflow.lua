@@ -13,6 +13,7 @@ local utils = require 'utils'
  * setConstraint(token[, by_count, goal, gap]) -> {...}
  * deleteConstraint(token) -> true/false
  * getCountHistory(token) -> {{...},...} or nil
+ * benchmarkMatching([count]) -> {items=..., linear_us=..., dispatch_us=..., ...}
 
 --]]
 
@@ -283,6 +283,7 @@ protected:
         end_entry_mode();
         search_string = "";
         saved_list1.clear();
+        clear_description_index();
     }
 
     // Shortcut to clear the search immediately
@@ -294,11 +295,13 @@ protected:
             saved_list1.clear();
         }
         search_string = "";
+        clear_description_index();
     }
 
     virtual void save_original_values()
     {
         saved_list1 = *primary_list;
+        build_description_index();
     }
 
     virtual void do_pre_incremental_search()
@@ -348,26 +351,49 @@ protected:
 
         clear_viewscreen_vectors();
 
+        // Subclasses may drop saved_list1 without going through save_original_values
+        if (saved_descriptions.size() != saved_list1.size())
+            build_description_index();
+
+        // Space separated words must all appear in the description, in any order
         string search_string_l = toLower(search_string);
-        for (size_t i = 0; i < saved_list1.size(); i++ )
+        vector<string> tokens;
+        split_string(&tokens, search_string_l, " ", true);
+
+        // Typing more characters can only remove matches, so only the previous
+        // results need to be checked again
+        bool narrow = !last_search.empty() && search_string_l.size() > last_search.size() &&
+            search_string_l.compare(0, last_search.size(), last_search) == 0;
+
+        vector<size_t> candidates;
+        if (narrow)
+            candidates.swap(last_result);
+        last_result.clear();
+
+        size_t count = narrow ? candidates.size() : saved_list1.size();
+        for (size_t n = 0; n < count; n++)
         {
+            size_t i = narrow ? candidates[n] : n;
+
             if (force_in_search(i))
             {
                 add_to_filtered_list(i);
+                last_result.push_back(i);
                 continue;
             }
 
             if (!is_valid_for_search(i))
                 continue;
 
-            T element = saved_list1[i];
-            string desc = toLower(get_element_description(element));
-            if (desc.find(search_string_l) != string::npos)
+            if (matches_tokens(saved_descriptions[i], tokens))
             {
                 add_to_filtered_list(i);
+                last_result.push_back(i);
             }
         }
 
+        last_search = search_string_l;
+
         do_post_search();
 
         if (cursor_pos)
@@ -401,6 +427,39 @@ protected:
     string search_string;
 
 private:
+    // Lowercased descriptions of saved_list1, built once per search
+    vector<string> saved_descriptions;
+    // Indexes into saved_list1 shown for last_search
+    vector<size_t> last_result;
+    string last_search;
+
+    void build_description_index()
+    {
+        saved_descriptions.resize(saved_list1.size());
+        for (size_t i = 0; i < saved_list1.size(); i++)
+            saved_descriptions[i] = toLower(get_element_description(saved_list1[i]));
+
+        last_result.clear();
+        last_search.clear();
+    }
+
+    void clear_description_index()
+    {
+        saved_descriptions.clear();
+        last_result.clear();
+        last_search.clear();
+    }
+
+    static bool matches_tokens(const string &desc, const vector<string> &tokens)
+    {
+        for (size_t t = 0; t < tokens.size(); t++)
+        {
+            if (desc.find(tokens[t]) == string::npos)
+                return false;
+        }
+        return true;
+    }
+
     int *cursor_pos;
     char select_key;
     bool valid;
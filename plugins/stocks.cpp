@@ -23,14 +23,17 @@
 #include "modules/World.h"
 #include "modules/Screen.h"
 #include "modules/Maps.h"
+#include "modules/EventManager.h"
 
 using df::global::world;
+using df::global::item_next_id;
 
 DFHACK_PLUGIN("stocks");
 #define PLUGIN_VERSION 0.2
 
 DFhackCExport command_result plugin_shutdown ( color_ostream &out )
 {
+    EventManager::unregisterAll(plugin_self);
     return CR_OK;
 }
 
@@ -457,6 +460,7 @@ public:
         items_column.multiselect = false;
         items_column.auto_select = true;
         items_column.allow_search = true;
+        items_column.use_search_index = true;
         items_column.left_margin = 2;
         items_column.bottom_margin = 1;
         items_column.search_margin = gps->dimx - SIDEBAR_WIDTH;
@@ -483,6 +487,17 @@ public:
         populateItems();
 
         items_column.selectDefaultEntry();
+
+        // keep the list and its search index current while the screen is open
+        active_screen = this;
+        EventManager::registerListener(EventManager::EventType::ITEM_CREATED, item_created_handler, plugin_self);
+    }
+
+    ~ViewscreenStocks()
+    {
+        EventManager::unregister(EventManager::EventType::ITEM_CREATED, item_created_handler, plugin_self);
+        if (active_screen == this)
+            active_screen = nullptr;
     }
 
     static void reset()
@@ -714,6 +729,12 @@ public:
 
         dfhack_viewscreen::render();
 
+        if (items_added)
+        {
+            items_column.filterDisplay();
+            items_added = false;
+        }
+
         Screen::clear();
         Screen::drawBorder("  Stocks  ");
 
@@ -778,6 +799,28 @@ private:
     df::item_quality min_quality, max_quality;
     int16_t min_wear;
 
+    int32_t next_item_id;
+    bool items_added;
+
+    static ViewscreenStocks *active_screen;
+    static EventManager::EventHandler item_created_handler;
+
+    static void onItemCreated(color_ostream &out, void *ptr)
+    {
+        if (!active_screen)
+            return;
+
+        // EventManager only tracks item ids while a listener is registered,
+        // so the first update replays items that populateItems already saw
+        int32_t id = int32_t(ptr);
+        if (id < active_screen->next_item_id)
+            return;
+
+        auto item = df::item::find(id);
+        if (item && active_screen->addItem(item))
+            active_screen->items_added = true;
+    }
+
     static df::coord *getRealPos(df::item *item)
     {
         item = get_container_of(item);
@@ -858,7 +901,22 @@ private:
     void populateItems()
     {
         items_column.clear();
+        next_item_id = *item_next_id;
+        items_added = false;
+
+        depot_info.prepareTradeVarables();
 
+        std::vector<df::item*> &items = world->items.other[items_other_id::IN_PLAY];
+
+        for (size_t i = 0; i < items.size(); i++)
+            addItem(items[i]);
+
+        items_column.filterDisplay();
+    }
+
+    // Adds the item to the list unless it is hidden by the current filters
+    bool addItem(df::item *item)
+    {
         df::item_flags bad_flags;
         bad_flags.whole = 0;
         bad_flags.bits.hostile = true;
@@ -871,90 +929,80 @@ private:
         bad_flags.bits.murder = true;
         bad_flags.bits.construction = true;
 
-        depot_info.prepareTradeVarables();
-
-        std::vector<df::item*> &items = world->items.other[items_other_id::IN_PLAY];
-
-        for (size_t i = 0; i < items.size(); i++)
-        {
-            df::item *item = items[i];
-
-            if (item->flags.whole & bad_flags.whole || item->flags.whole & hide_flags.whole)
-                continue;
+        if (item->flags.whole & bad_flags.whole || item->flags.whole & hide_flags.whole)
+            return false;
 
-            auto container = get_container_of(item);
-            if (container->flags.whole & bad_flags.whole)
-                continue;
+        auto container = get_container_of(item);
+        if (container->flags.whole & bad_flags.whole)
+            return false;
 
-            auto pos = getRealPos(item);
-            if (!pos)
-                continue;
+        auto pos = getRealPos(item);
+        if (!pos)
+            return false;
 
-            if (pos->x == -30000)
-                continue;
+        if (pos->x == -30000)
+            return false;
 
-            auto designation = Maps::getTileDesignation(*pos);
-            if (!designation)
-                continue;
+        auto designation = Maps::getTileDesignation(*pos);
+        if (!designation)
+            return false;
 
-            if (designation->bits.hidden)
-                continue; // Items in parts of the map not yet revealed
+        if (designation->bits.hidden)
+            return false; // Items in parts of the map not yet revealed
 
-            bool trade_marked = is_marked_for_trade(item, container);
-            if (extra_hide_flags.hide_trade_marked && trade_marked)
-                continue;
+        bool trade_marked = is_marked_for_trade(item, container);
+        if (extra_hide_flags.hide_trade_marked && trade_marked)
+            return false;
 
-            if (extra_hide_flags.hide_in_inventory && container->flags.bits.in_inventory)
-                continue;
+        if (extra_hide_flags.hide_in_inventory && container->flags.bits.in_inventory)
+            return false;
 
-            if (hide_unflagged && (!(item->flags.whole & checked_flags.whole) && 
-                    !trade_marked && !container->flags.bits.in_inventory))
-            {
-                continue;
-            }
+        if (hide_unflagged && (!(item->flags.whole & checked_flags.whole) && 
+                !trade_marked && !container->flags.bits.in_inventory))
+        {
+            return false;
+        }
 
-            auto quality = static_cast<df::item_quality>(item->getQuality());
-            if (quality < min_quality || quality > max_quality)
-                continue;
+        auto quality = static_cast<df::item_quality>(item->getQuality());
+        if (quality < min_quality || quality > max_quality)
+            return false;
 
-            auto wear = item->getWear();
-            if (wear < min_wear)
-                continue;
+        auto wear = item->getWear();
+        if (wear < min_wear)
+            return false;
 
-            auto label = Items::getDescription(item, 0, false);
-            if (wear > 0)
+        auto label = Items::getDescription(item, 0, false);
+        if (wear > 0)
+        {
+            string wearX;
+            switch (wear)
             {
-                string wearX;
-                switch (wear)
-                {
-                case 1:
-                    wearX = "x";
-                    break;
-
-                case 2:
-                    wearX = "X";
-                    break;
+            case 1:
+                wearX = "x";
+                break;
 
-                case 3:
-                    wearX = "xX";
-                    break;
+            case 2:
+                wearX = "X";
+                break;
 
-                default:
-                    wearX = "XX";
-                    break;
+            case 3:
+                wearX = "xX";
+                break;
 
-                }
+            default:
+                wearX = "XX";
+                break;
 
-                label = wearX + label + wearX;
             }
 
-            label = pad_string(label, MAX_NAME, false, true);
-
-            auto entry = ListEntry<df::item *>(label, item, get_keywords(item));
-            items_column.add(entry);
+            label = wearX + label + wearX;
         }
 
-        items_column.filterDisplay();
+        label = pad_string(label, MAX_NAME, false, true);
+
+        auto entry = ListEntry<df::item *>(label, item, get_keywords(item));
+        items_column.add(entry);
+        return true;
     }
 
     void validateColumn()
@@ -972,6 +1020,8 @@ private:
 
 df::item_flags ViewscreenStocks::hide_flags;
 extra_filters ViewscreenStocks::extra_hide_flags;
+ViewscreenStocks *ViewscreenStocks::active_screen = nullptr;
+EventManager::EventHandler ViewscreenStocks::item_created_handler(ViewscreenStocks::onItemCreated, 1);
 
 
 static command_result stocks_cmd(color_ostream &out, vector <string> & parameters)
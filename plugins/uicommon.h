@@ -2,6 +2,7 @@
 #include <map>
 #include <string>
 #include <set>
+#include <unordered_map>
 
 #include "Core.h"
 #include "MiscUtils.h"
@@ -162,6 +163,89 @@ public:
     }
 };
 
+/*
+ * Trigram index for substring search over lowercased documents with dense
+ * ids, added in increasing order. A query only verifies the documents listed
+ * under the rarest trigram of its terms instead of scanning all of them;
+ * terms shorter than three characters fall back to a full scan.
+ */
+class TrigramIndex
+{
+public:
+    void clear()
+    {
+        postings.clear();
+        docs.clear();
+    }
+
+    size_t size() const
+    {
+        return docs.size();
+    }
+
+    void add(uint32_t id, const string &text)
+    {
+        if (id >= docs.size())
+            docs.resize(id + 1);
+        docs[id] = text;
+
+        for (size_t i = 0; i + 3 <= text.size(); i++)
+        {
+            auto &ids = postings[trigram(&text[i])];
+            if (ids.empty() || ids.back() != id)
+                ids.push_back(id);
+        }
+    }
+
+    // Ids of the documents that contain every non-empty term, in increasing order
+    void query(const vector<string> &terms, vector<uint32_t> *out) const
+    {
+        out->clear();
+
+        const vector<uint32_t> *candidates = NULL;
+        for (auto term = terms.begin(); term != terms.end(); term++)
+        {
+            for (size_t i = 0; i + 3 <= term->size(); i++)
+            {
+                auto it = postings.find(trigram(&(*term)[i]));
+                if (it == postings.end())
+                    return;
+
+                if (!candidates || it->second.size() < candidates->size())
+                    candidates = &it->second;
+            }
+        }
+
+        size_t count = candidates ? candidates->size() : docs.size();
+        for (size_t n = 0; n < count; n++)
+        {
+            uint32_t id = candidates ? (*candidates)[n] : n;
+            if (matches(docs[id], terms))
+                out->push_back(id);
+        }
+    }
+
+    static bool matches(const string &doc, const vector<string> &terms)
+    {
+        for (auto term = terms.begin(); term != terms.end(); term++)
+        {
+            if (!term->empty() && doc.find(*term) == string::npos)
+                return false;
+        }
+        return true;
+    }
+
+private:
+    static uint32_t trigram(const char *p)
+    {
+        return (uint8_t(p[0]) << 16) | (uint8_t(p[1]) << 8) | uint8_t(p[2]);
+    }
+
+    std::unordered_map<uint32_t, vector<uint32_t>> postings;
+    vector<string> docs;
+};
+
+
 template <typename T>
 class ListColumn
 {
@@ -176,6 +260,7 @@ public:
     bool force_sort;
     bool allow_search;
     bool feed_changed_highlight;
+    bool use_search_index; // search through a TrigramIndex, for long lists
 
     ListColumn()
     {
@@ -191,12 +276,14 @@ public:
         force_sort = false;
         allow_search = true;
         feed_changed_highlight = false;
+        use_search_index = false;
     }
 
     void clear()
     {
         list.clear();
         display_list.clear();
+        search_index.clear();
         display_start_offset = 0;
         max_item_width = title.length();
         resize();
@@ -230,6 +317,7 @@ public:
         {
             it->text = pad_string(it->text, max_item_width, false);
         }
+        search_index.clear();
 
         return left_margin + max_item_width;
     }
@@ -278,12 +366,29 @@ public:
         if (!search_string.empty())
             split_string(&search_tokens, search_string, " ");
 
+        vector<uint32_t> matches;
+        size_t next_match = 0;
+        bool indexed = use_search_index && !search_string.empty();
+        if (indexed)
+        {
+            // entries added since the last search are indexed now
+            for (size_t i = search_index.size(); i < list.size(); i++)
+                search_index.add(i, toLower(list[i].text) + "\n" + list[i].keywords);
+            search_index.query(search_tokens, &matches);
+        }
+
         for (size_t i = 0; i < list.size(); i++)
         {
             ListEntry<T> *entry = &list[i];
 
             bool include_item = true;
-            if (!search_string.empty())
+            if (indexed)
+            {
+                include_item = next_match < matches.size() && matches[next_match] == i;
+                if (include_item)
+                    next_match++;
+            }
+            else if (!search_string.empty())
             {
                 string item_string = toLower(list[i].text);
                 for (auto si = search_tokens.begin(); si != search_tokens.end(); si++)
@@ -550,7 +655,10 @@ public:
     void sort()
     {
         if (force_sort || list.size() < 100)
+        {
             std::sort(list.begin(), list.end(), sort_fn);
+            search_index.clear();
+        }
 
         filterDisplay();
     }
@@ -573,6 +681,7 @@ private:
 
     vector<ListEntry<T>> list;
     vector<ListEntry<T>*> display_list;
+    TrigramIndex search_index;
     string search_string;
     string title;
     int display_max_rows;
@@ -12,6 +12,7 @@
 #include "modules/Gui.h"
 #include "modules/Job.h"
 #include "modules/World.h"
+#include "modules/EventManager.h"
 
 #include "DataDefs.h"
 #include "df/world.h"
@@ -42,6 +43,8 @@
 #include "df/builtin_mats.h"
 #include "df/vehicle.h"
 
+#include <unordered_map>
+
 using std::vector;
 using std::string;
 using std::endl;
@@ -290,7 +293,13 @@ public:
 
 int ProtectedJob::cur_tick_idx = 0;
 
-typedef std::map<std::pair<int,int>, bool> TMaterialCache;
+struct MaterialKeyHash {
+    size_t operator() (const std::pair<int,int> &key) const {
+        return size_t(key.first) * 65537 + size_t(key.second);
+    }
+};
+
+typedef std::unordered_map<std::pair<int,int>, bool, MaterialKeyHash> TMaterialCache;
 
 static const size_t MAX_HISTORY_SIZE = 28;
 
@@ -479,6 +488,10 @@ static void stop_protect(color_ostream &out)
     known_jobs.clear();
 }
 
+static void invalidate_item_index();
+static void clear_item_index();
+static void watch_created_items(bool enable);
+
 static void cleanup_state(color_ostream &out)
 {
     config = PersistentDataItem();
@@ -488,6 +501,9 @@ static void cleanup_state(color_ostream &out)
     for (size_t i = 0; i < constraints.size(); i++)
         delete constraints[i];
     constraints.clear();
+
+    watch_created_items(false);
+    clear_item_index();
 }
 
 static void check_lost_jobs(color_ostream &out, int ticks);
@@ -524,6 +540,8 @@ static void init_state(color_ostream &out)
     last_tick_frame_count = world->frame_counter;
     last_frame_count = world->frame_counter;
 
+    watch_created_items(true);
+
     if (!enabled)
         return;
 
@@ -832,6 +850,7 @@ static ItemConstraint *get_constraint(color_ostream &out, const std::string &str
     nct->history = World::GetPersistentData(history_key(nct->config), NULL);
 
     constraints.push_back(nct);
+    invalidate_item_index();
     return nct;
 }
 
@@ -841,6 +860,8 @@ static void delete_constraint(ItemConstraint *cv)
     if (idx >= 0)
         vector_erase_at(constraints, idx);
 
+    invalidate_item_index();
+
     World::DeletePersistentData(cv->config);
     World::DeletePersistentData(cv->history);
     delete cv;
@@ -1114,137 +1135,426 @@ static bool isAssignedSquad(df::item *item)
     return binsearch_index(vec, &df::item::id, item->id) >= 0;
 }
 
-static void map_job_items(color_ostream &out)
+/*
+ * Item counts are maintained incrementally. Items that can contribute to
+ * the counts (matching some constraint, or designated for melting) are
+ * recorded with their fixed properties, the list of matching constraints
+ * and what they contributed. A pass re-evaluates only the recorded items
+ * and the ones reported by ITEM_CREATED since the previous pass; the full
+ * sweep over all items in play is done when the constraints change, and
+ * periodically to pick up items that became relevant without being created.
+ */
+
+static const int ITEM_INDEX_REBUILD_PASSES = 8;
+
+struct ItemMatchKey {
+    int16_t type, subtype, mattype;
+    int32_t matindex;
+
+    ItemMatchKey(int16_t type, int16_t subtype, int16_t mattype, int32_t matindex)
+        : type(type), subtype(subtype), mattype(mattype), matindex(matindex) {}
+
+    bool operator< (const ItemMatchKey &other) const {
+        if (type != other.type) return type < other.type;
+        if (subtype != other.subtype) return subtype < other.subtype;
+        if (mattype != other.mattype) return mattype < other.mattype;
+        return matindex < other.matindex;
+    }
+};
+
+typedef std::vector<ItemConstraint*> TConstraintList;
+
+struct IndexedItem {
+    df::item *item;
+    int generation;
+
+    // Fixed properties
+    df::item_type type;
+    int16_t quality;
+    TConstraintList *matches;
+
+    // State at the last evaluation
+    uint32_t flags;
+    int stack_size;
+
+    // Contribution to the counts
+    bool counted, inuse, foreign, meltable;
+
+    IndexedItem() : item(NULL), generation(0), matches(NULL), counted(false), meltable(false) {}
+};
+
+// Candidate constraints by item type; craft constraints are added to all craft types
+static std::vector<TConstraintList> constraints_by_type;
+
+static std::map<ItemMatchKey, TConstraintList> match_index;
+static std::unordered_map<int32_t, IndexedItem> item_index;
+static int item_index_generation = 0;
+static int item_index_passes = 0;
+static bool item_index_dirty = true;
+static std::vector<int32_t> created_items;
+static bool item_index_dry_buckets = false;
+static size_t item_index_squad_items = 0;
+
+static void invalidate_item_index()
+{
+    item_index_dirty = true;
+}
+
+static void clear_item_index()
+{
+    item_index.clear();
+    match_index.clear();
+    created_items.clear();
+    item_index_dirty = true;
+}
+
+static void onItemCreated(color_ostream &out, void *ptr)
 {
+    // The next full sweep will see the item anyway
+    if (item_index_dirty)
+        return;
+
+    // Nothing consumes the list while disabled
+    if (!enabled)
+    {
+        created_items.clear();
+        item_index_dirty = true;
+        return;
+    }
+
+    created_items.push_back(int32_t(ptr));
+}
+
+static EventManager::EventHandler item_created_handler(onItemCreated, 100);
+
+static void watch_created_items(bool enable)
+{
+    if (enable)
+        EventManager::registerListener(EventManager::EventType::ITEM_CREATED, item_created_handler, plugin_self);
+    else
+        EventManager::unregister(EventManager::EventType::ITEM_CREATED, item_created_handler, plugin_self);
+}
+
+static void build_constraint_dispatch()
+{
+    constraints_by_type.clear();
+    constraints_by_type.resize(ENUM_LAST_ITEM(item_type)+1);
+
+    TConstraintList crafts;
+
     for (size_t i = 0; i < constraints.size(); i++)
     {
-        constraints[i]->item_amount = 0;
-        constraints[i]->item_count = 0;
-        constraints[i]->item_inuse_amount = 0;
-        constraints[i]->item_inuse_count = 0;
+        ItemConstraint *cv = constraints[i];
+
+        if (cv->is_craft)
+            crafts.push_back(cv);
+        else if (cv->item.type >= 0 && size_t(cv->item.type) < constraints_by_type.size())
+            constraints_by_type[cv->item.type].push_back(cv);
     }
 
-    meltable_count = 0;
+    if (crafts.empty())
+        return;
 
-    // Precompute a bitmask with the bad flags
-    df::item_flags bad_flags;
-    bad_flags.whole = 0;
+    FOR_ENUM_ITEMS(item_type, itype)
+    {
+        if (itype >= 0 && isCraftItem(itype))
+        {
+            TConstraintList &list = constraints_by_type[itype];
+            list.insert(list.end(), crafts.begin(), crafts.end());
+        }
+    }
+}
 
-#define F(x) bad_flags.bits.x = true;
-    F(dump); F(forbid); F(garbage_collect);
-    F(hostile); F(on_fire); F(rotten); F(trader);
-    F(in_building); F(construction); F(artifact);
-#undef F
+static bool matchesMaterial(ItemConstraint *cv, int16_t imattype, int32_t imatindex)
+{
+    TMaterialCache::key_type matkey(imattype, imatindex);
+    TMaterialCache::iterator it = cv->material_cache.find(matkey);
 
-    bool dry_buckets = isOptionEnabled(CF_DRYBUCKETS);
+    if (it != cv->material_cache.end())
+        return it->second;
 
-    std::vector<df::item*> &items = world->items.other[items_other_id::IN_PLAY];
+    MaterialInfo mat(imattype, imatindex);
+    bool ok = mat.matches(cv->material) &&
+              (cv->mat_mask.whole == 0 || mat.matches(cv->mat_mask));
+    cv->material_cache[matkey] = ok;
+    return ok;
+}
 
-    for (size_t i = 0; i < items.size(); i++)
+static void find_item_matches(TConstraintList *list, df::item_type itype, int16_t isubtype,
+                              int16_t imattype, int32_t imatindex)
+{
+    if (itype < 0 || size_t(itype) >= constraints_by_type.size())
+        return;
+
+    TConstraintList &candidates = constraints_by_type[itype];
+
+    for (size_t i = 0; i < candidates.size(); i++)
     {
-        df::item *item = items[i];
+        ItemConstraint *cv = candidates[i];
 
-        if (item->flags.whole & bad_flags.whole)
+        if (!cv->is_craft && cv->item.subtype != -1 && cv->item.subtype != isubtype)
             continue;
 
-        df::item_type itype = item->getType();
-        int16_t isubtype = item->getSubtype();
-        int16_t imattype = item->getActualMaterial();
-        int32_t imatindex = item->getActualMaterialIndex();
+        if (matchesMaterial(cv, imattype, imatindex))
+            list->push_back(cv);
+    }
+}
 
-        bool is_invalid = false;
+static TConstraintList *get_item_matches(df::item_type itype, int16_t isubtype,
+                                         int16_t imattype, int32_t imatindex)
+{
+    ItemMatchKey key(itype, isubtype, imattype, imatindex);
 
-        // don't count worn items
-        if (item->getWear() >= 1)
+    auto it = match_index.find(key);
+    if (it != match_index.end())
+        return &it->second;
+
+    TConstraintList &list = match_index[key];
+    find_item_matches(&list, itype, isubtype, imattype, imatindex);
+    return &list;
+}
+
+static bool matchesItemFilters(ItemConstraint *cv, IndexedItem &entry)
+{
+    if (cv->is_local && entry.foreign)
+        return false;
+    return entry.quality >= cv->min_quality;
+}
+
+static void count_indexed_item(IndexedItem &entry, int sign)
+{
+    if (entry.meltable)
+        meltable_count += sign;
+
+    if (!entry.counted)
+        return;
+
+    int amount = entry.stack_size * sign;
+    TConstraintList &list = *entry.matches;
+
+    for (size_t i = 0; i < list.size(); i++)
+    {
+        ItemConstraint *cv = list[i];
+        if (!matchesItemFilters(cv, entry))
+            continue;
+
+        if (entry.inuse)
+        {
+            cv->item_inuse_count += sign;
+            cv->item_inuse_amount += amount;
+        }
+        else
+        {
+            cv->item_count += sign;
+            cv->item_amount += amount;
+        }
+    }
+}
+
+static void evaluate_indexed_item(IndexedItem &entry, df::item_flags bad_flags, bool dry_buckets)
+{
+    df::item *item = entry.item;
+
+    entry.counted = entry.meltable = false;
+
+    if (entry.flags & bad_flags.whole)
+        return;
+
+    bool is_invalid = false;
+
+    // don't count worn items
+    if (item->getWear() >= 1)
+        is_invalid = true;
+
+    // Special handling
+    switch (entry.type) {
+    case item_type::BUCKET:
+        if (dry_buckets && !item->flags.bits.in_job)
+            dryBucket(item);
+        break;
+
+    case item_type::THREAD:
+        if (item->flags.bits.spider_web)
+            return;
+        if (item->getTotalDimension() < 15000)
             is_invalid = true;
+        break;
 
-        // Special handling
-        switch (itype) {
-        case item_type::BUCKET:
-            if (dry_buckets && !item->flags.bits.in_job)
-                dryBucket(item);
-            break;
+    case item_type::CLOTH:
+        if (item->getTotalDimension() < 10000)
+            is_invalid = true;
+        break;
 
-        case item_type::THREAD:
-            if (item->flags.bits.spider_web)
-                continue;
-            if (item->getTotalDimension() < 15000)
-                is_invalid = true;
-            break;
+    default:
+        break;
+    }
 
-        case item_type::CLOTH:
-            if (item->getTotalDimension() < 10000)
-                is_invalid = true;
-            break;
+    if (item->flags.bits.melt && !item->flags.bits.owned && !itemBusy(item))
+        entry.meltable = true;
 
-        default:
-            break;
+    // Match to constraints
+    entry.foreign = item->flags.bits.foreign;
+
+    TConstraintList &list = *entry.matches;
+    for (size_t i = 0; i < list.size() && !entry.counted; i++)
+        entry.counted = matchesItemFilters(list[i], entry);
+
+    if (!entry.counted)
+        return;
+
+    entry.inuse = is_invalid ||
+                  item->flags.bits.owned ||
+                  item->flags.bits.in_chest ||
+                  item->isAssignedToStockpile() ||
+                  isRouteVehicle(item) ||
+                  itemInRealJob(item) ||
+                  itemBusy(item) ||
+                  isAssignedSquad(item);
+}
+
+static void reevaluate_indexed_item(IndexedItem &entry, df::item_flags bad_flags, bool dry_buckets)
+{
+    count_indexed_item(entry, -1);
+
+    entry.flags = entry.item->flags.whole;
+    entry.stack_size = entry.item->getStackSize();
+    evaluate_indexed_item(entry, bad_flags, dry_buckets);
+
+    count_indexed_item(entry, 1);
+}
+
+static void update_indexed_item(df::item *item, df::item_flags bad_flags, bool dry_buckets, int generation)
+{
+    auto it = item_index.find(item->id);
+    if (it != item_index.end())
+    {
+        if (it->second.item == item)
+        {
+            it->second.generation = generation;
+            reevaluate_indexed_item(it->second, bad_flags, dry_buckets);
+            return;
         }
 
-        if (item->flags.bits.melt && !item->flags.bits.owned && !itemBusy(item))
-            meltable_count++;
+        count_indexed_item(it->second, -1);
+        item_index.erase(it);
+    }
+
+    df::item_type type = item->getType();
+    TConstraintList *matches = get_item_matches(type, item->getSubtype(),
+                                                item->getActualMaterial(),
+                                                item->getActualMaterialIndex());
+
+    // Only record items that can contribute to the counts
+    if (matches->empty() && !item->flags.bits.melt &&
+        !(dry_buckets && type == item_type::BUCKET))
+        return;
+
+    IndexedItem &entry = item_index[item->id];
+    entry.item = item;
+    entry.generation = generation;
+    entry.type = type;
+    entry.quality = item->getQuality();
+    entry.matches = matches;
+    reevaluate_indexed_item(entry, bad_flags, dry_buckets);
+}
+
+static size_t count_squad_items()
+{
+    size_t count = 0;
+    auto &assigned = ui->equipment.items_assigned;
+    for (size_t i = 0; i < sizeof(assigned)/sizeof(assigned[0]); i++)
+        count += assigned[i].size();
+    return count;
+}
+
+static void map_job_items(color_ostream &out)
+{
+    bool dry_buckets = isOptionEnabled(CF_DRYBUCKETS);
+    size_t squad_items = count_squad_items();
+
+    // Recount everything if needed
+    bool full_sweep = item_index_dirty ||
+                      ++item_index_passes >= ITEM_INDEX_REBUILD_PASSES ||
+                      dry_buckets != item_index_dry_buckets ||
+                      squad_items != item_index_squad_items;
 
-        // Match to constraints
-        TMaterialCache::key_type matkey(imattype, imatindex);
+    if (full_sweep)
+    {
+        item_index.clear();
+        match_index.clear();
+        build_constraint_dispatch();
 
         for (size_t i = 0; i < constraints.size(); i++)
         {
-            ItemConstraint *cv = constraints[i];
+            constraints[i]->item_amount = 0;
+            constraints[i]->item_count = 0;
+            constraints[i]->item_inuse_amount = 0;
+            constraints[i]->item_inuse_count = 0;
+        }
 
-            if (cv->is_craft)
-            {
-                if (!isCraftItem(itype))
-                    continue;
-            }
-            else
-            {
-                if (cv->item.type != itype ||
-                    (cv->item.subtype != -1 && cv->item.subtype != isubtype))
-                    continue;
-            }
+        meltable_count = 0;
 
-            if (cv->is_local && item->flags.bits.foreign)
-                continue;
-            if (item->getQuality() < cv->min_quality)
-                continue;
+        item_index_dirty = false;
+        item_index_passes = 0;
+        item_index_dry_buckets = dry_buckets;
+        item_index_squad_items = squad_items;
+    }
 
-            TMaterialCache::iterator it = cv->material_cache.find(matkey);
+    // Precompute a bitmask with the bad flags
+    df::item_flags bad_flags;
+    bad_flags.whole = 0;
 
-            bool ok = true;
-            if (it != cv->material_cache.end())
-                ok = it->second;
-            else
-            {
-                MaterialInfo mat(imattype, imatindex);
-                ok = mat.matches(cv->material) &&
-                     (cv->mat_mask.whole == 0 || mat.matches(cv->mat_mask));
-                cv->material_cache[matkey] = ok;
-            }
+#define F(x) bad_flags.bits.x = true;
+    F(dump); F(forbid); F(garbage_collect);
+    F(hostile); F(on_fire); F(rotten); F(trader);
+    F(in_building); F(construction); F(artifact);
+#undef F
 
-            if (!ok)
-                continue;
+    int generation = ++item_index_generation;
+
+    if (full_sweep)
+    {
+        std::vector<df::item*> &items = world->items.other[items_other_id::IN_PLAY];
 
-            if (is_invalid ||
-                item->flags.bits.owned ||
-                item->flags.bits.in_chest ||
-                item->isAssignedToStockpile() ||
-                isRouteVehicle(item) ||
-                itemInRealJob(item) ||
-                itemBusy(item) ||
-                isAssignedSquad(item))
+        for (size_t i = 0; i < items.size(); i++)
+            update_indexed_item(items[i], bad_flags, dry_buckets, generation);
+    }
+    else
+    {
+        for (size_t i = 0; i < created_items.size(); i++)
+        {
+            df::item *item = df::item::find(created_items[i]);
+            if (item && !item->flags.bits.removed)
+                update_indexed_item(item, bad_flags, dry_buckets, generation);
+        }
+
+        // Refresh the other recorded items, forgetting the ones that left play
+        for (auto it = item_index.begin(); it != item_index.end(); )
+        {
+            IndexedItem &entry = it->second;
+            if (entry.generation == generation)
             {
-                is_invalid = true;
-                cv->item_inuse_count++;
-                cv->item_inuse_amount += item->getStackSize();
+                ++it;
+                continue;
             }
-            else
+
+            // Look the item up by id, since the recorded pointer may be dangling
+            df::item *item = df::item::find(it->first);
+            if (item != entry.item || item->flags.bits.removed)
             {
-                cv->item_count++;
-                cv->item_amount += item->getStackSize();
+                count_indexed_item(entry, -1);
+                it = item_index.erase(it);
+                continue;
             }
+
+            entry.generation = generation;
+            reevaluate_indexed_item(entry, bad_flags, dry_buckets);
+            ++it;
         }
     }
 
+    created_items.clear();
+
     for (size_t i = 0; i < constraints.size(); i++)
         constraints[i]->computeRequest();
 }
@@ -1597,6 +1907,125 @@ static int getCountHistory(lua_State *L)
 }
 
 
+/*
+ * Matches a synthetic item set, resampled from the item keys in play,
+ * against the constraints: once with a linear scan of all constraints
+ * and an ordered material cache, and once using the dispatch table and
+ * the hashed caches. Each variant is run twice, timing the second run.
+ */
+static int benchmarkMatching(lua_State *L)
+{
+    int count = luaL_optint(L, 1, 100000);
+    luaL_argcheck(L, count > 0, 1, "positive item count expected");
+
+    auto &items = world->items.other[items_other_id::IN_PLAY];
+    if (items.empty())
+        luaL_error(L, "no items in play");
+
+    struct SyntheticItem {
+        df::item_type type;
+        int16_t subtype, mattype;
+        int32_t matindex;
+    };
+
+    std::vector<SyntheticItem> set(count);
+    uint32_t seed = 12345;
+
+    for (int i = 0; i < count; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        df::item *item = items[(seed >> 8) % items.size()];
+
+        set[i].type = item->getType();
+        set[i].subtype = item->getSubtype();
+        set[i].mattype = item->getActualMaterial();
+        set[i].matindex = item->getActualMaterialIndex();
+    }
+
+    build_constraint_dispatch();
+
+    // Linear scan
+    std::vector<std::map<std::pair<int,int>, bool> > linear_caches(constraints.size());
+    size_t linear_matches = 0;
+    uint64_t linear_us = 0;
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        uint64_t start = GetTimeUs64();
+        linear_matches = 0;
+
+        for (int i = 0; i < count; i++)
+        {
+            SyntheticItem &si = set[i];
+            std::pair<int,int> matkey(si.mattype, si.matindex);
+
+            for (size_t j = 0; j < constraints.size(); j++)
+            {
+                ItemConstraint *cv = constraints[j];
+
+                if (cv->is_craft)
+                {
+                    if (!isCraftItem(si.type))
+                        continue;
+                }
+                else if (cv->item.type != si.type ||
+                         (cv->item.subtype != -1 && cv->item.subtype != si.subtype))
+                    continue;
+
+                auto &cache = linear_caches[j];
+                auto it = cache.find(matkey);
+
+                bool ok;
+                if (it != cache.end())
+                    ok = it->second;
+                else
+                {
+                    MaterialInfo mat(si.mattype, si.matindex);
+                    ok = mat.matches(cv->material) &&
+                         (cv->mat_mask.whole == 0 || mat.matches(cv->mat_mask));
+                    cache[matkey] = ok;
+                }
+
+                if (ok)
+                    linear_matches++;
+            }
+        }
+
+        linear_us = GetTimeUs64() - start;
+    }
+
+    // Dispatch table
+    TConstraintList list;
+    size_t dispatch_matches = 0;
+    uint64_t dispatch_us = 0;
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        uint64_t start = GetTimeUs64();
+        dispatch_matches = 0;
+
+        for (int i = 0; i < count; i++)
+        {
+            SyntheticItem &si = set[i];
+
+            list.clear();
+            find_item_matches(&list, si.type, si.subtype, si.mattype, si.matindex);
+            dispatch_matches += list.size();
+        }
+
+        dispatch_us = GetTimeUs64() - start;
+    }
+
+    lua_newtable(L);
+    Lua::SetField(L, count, -1, "items");
+    Lua::SetField(L, int(constraints.size()), -1, "constraints");
+    Lua::SetField(L, double(linear_us), -1, "linear_us");
+    Lua::SetField(L, double(linear_matches), -1, "linear_matches");
+    Lua::SetField(L, double(dispatch_us), -1, "dispatch_us");
+    Lua::SetField(L, double(dispatch_matches), -1, "dispatch_matches");
+    return 1;
+}
+
 DFHACK_PLUGIN_LUA_FUNCTIONS {
     DFHACK_LUA_FUNCTION(deleteConstraint),
     DFHACK_LUA_END
@@ -1607,6 +2036,7 @@ DFHACK_PLUGIN_LUA_COMMANDS {
     DFHACK_LUA_COMMAND(findConstraint),
     DFHACK_LUA_COMMAND(setConstraint),
     DFHACK_LUA_COMMAND(getCountHistory),
+    DFHACK_LUA_COMMAND(benchmarkMatching),
     DFHACK_LUA_END
 };
 
@@ -31,6 +31,8 @@
 #include <vector>
 #include <algorithm>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <sstream>
 #include <ctime>
 #include <cstdio>
@@ -261,6 +263,8 @@ command_result start_autonestbox(color_ostream &out);
 command_result autoNestbox( color_ostream &out, bool verbose );
 command_result autoButcher( color_ostream &out, bool verbose );
 
+static void clearRaceRawFlags();
+
 static bool enable_autonestbox = false;
 static bool enable_autobutcher = false;
 static bool enable_autobutcher_autowatch = false;
@@ -268,6 +272,11 @@ static size_t sleep_autonestbox = 6000;
 static size_t sleep_autobutcher = 6000;
 static bool autonestbox_did_complain = false; // avoids message spam
 
+// statistics of the last autobutcher pass, shown by 'autobutcher list'
+static uint64_t last_autobutcher_us = 0;
+static size_t last_autobutcher_units = 0;
+static size_t last_autobutcher_races = 0;
+
 static PersistentDataItem config_autobutcher;
 static PersistentDataItem config_autonestbox;
 
@@ -287,6 +296,7 @@ DFhackCExport command_result plugin_onstatechange(color_ostream &out, state_chan
         // cleanup
         cleanup_autobutcher(out);
         cleanup_autonestbox(out);
+        clearRaceRawFlags();
         break;
     default:
         break;
@@ -496,8 +506,8 @@ bool isHunter(df::unit* unit)
 // check if unit is marked as available for adoption
 bool isAvailableForAdoption(df::unit* unit)
 {
-    auto refs = unit->specific_refs;
-    for(int i=0; i<refs.size(); i++)
+    auto &refs = unit->specific_refs;
+    for(size_t i=0; i<refs.size(); i++)
     {
         auto ref = refs[i];
         auto reftype = ref->type;
@@ -572,84 +582,89 @@ bool isAdult(df::unit* unit)
     return !isBaby(unit) && !isChild(unit);
 }
 
+// caste-level raw flags, cached per race since every unit of a race shares them
+struct RaceRawFlags
+{
+    bool valid;
+    bool egg_layer;
+    bool grazer;
+    bool milkable;
+    bool trainable_war;
+    bool trainable_hunting;
+    bool tamable;
+};
+
+static vector<RaceRawFlags> race_raw_flags;
+
+static const RaceRawFlags &getRaceRawFlags(int32_t race)
+{
+    if (race_raw_flags.size() != world->raws.creatures.all.size())
+    {
+        race_raw_flags.clear();
+        race_raw_flags.resize(world->raws.creatures.all.size());
+    }
+
+    RaceRawFlags &flags = race_raw_flags[race];
+    if (!flags.valid)
+    {
+        df::creature_raw *raw = world->raws.creatures.all[race];
+        size_t sizecas = raw->caste.size();
+        for (size_t j = 0; j < sizecas;j++)
+        {
+            df::caste_raw *caste = raw->caste[j];
+            if(   caste->flags.is_set(caste_raw_flags::LAYS_EGGS)
+                || caste->flags.is_set(caste_raw_flags::LAYS_UNUSUAL_EGGS))
+                flags.egg_layer = true;
+            if(caste->flags.is_set(caste_raw_flags::GRAZER))
+                flags.grazer = true;
+            if(caste->flags.is_set(caste_raw_flags::MILKABLE))
+                flags.milkable = true;
+            if(caste->flags.is_set(caste_raw_flags::TRAINABLE_WAR))
+                flags.trainable_war = true;
+            if(caste->flags.is_set(caste_raw_flags::TRAINABLE_HUNTING))
+                flags.trainable_hunting = true;
+            if(caste->flags.is_set(caste_raw_flags::PET) ||
+                caste->flags.is_set(caste_raw_flags::PET_EXOTIC))
+                flags.tamable = true;
+        }
+        flags.valid = true;
+    }
+    return flags;
+}
+
+static void clearRaceRawFlags()
+{
+    race_raw_flags.clear();
+}
+
 bool isEggLayer(df::unit* unit)
 {
-    df::creature_raw *raw = df::global::world->raws.creatures.all[unit->race];
-    size_t sizecas = raw->caste.size();
-    for (size_t j = 0; j < sizecas;j++)
-    {
-        df::caste_raw *caste = raw->caste[j];
-        if(   caste->flags.is_set(caste_raw_flags::LAYS_EGGS)
-            || caste->flags.is_set(caste_raw_flags::LAYS_UNUSUAL_EGGS))
-            return true;
-    }
-    return false;
+    return getRaceRawFlags(unit->race).egg_layer;
 }
 
 bool isGrazer(df::unit* unit)
 {
-    df::creature_raw *raw = df::global::world->raws.creatures.all[unit->race];
-    size_t sizecas = raw->caste.size();
-    for (size_t j = 0; j < sizecas;j++)
-    {
-        df::caste_raw *caste = raw->caste[j];
-        if(caste->flags.is_set(caste_raw_flags::GRAZER))
-            return true;
-    }
-    return false;
+    return getRaceRawFlags(unit->race).grazer;
 }
 
 bool isMilkable(df::unit* unit)
 {
-    df::creature_raw *raw = df::global::world->raws.creatures.all[unit->race];
-    size_t sizecas = raw->caste.size();
-    for (size_t j = 0; j < sizecas;j++)
-    {
-        df::caste_raw *caste = raw->caste[j];
-        if(caste->flags.is_set(caste_raw_flags::MILKABLE))
-            return true;
-    }
-    return false;
+    return getRaceRawFlags(unit->race).milkable;
 }
 
 bool isTrainableWar(df::unit* unit)
 {
-    df::creature_raw *raw = df::global::world->raws.creatures.all[unit->race];
-    size_t sizecas = raw->caste.size();
-    for (size_t j = 0; j < sizecas;j++)
-    {
-        df::caste_raw *caste = raw->caste[j];
-        if(caste->flags.is_set(caste_raw_flags::TRAINABLE_WAR))
-            return true;
-    }
-    return false;
+    return getRaceRawFlags(unit->race).trainable_war;
 }
 
 bool isTrainableHunting(df::unit* unit)
 {
-    df::creature_raw *raw = df::global::world->raws.creatures.all[unit->race];
-    size_t sizecas = raw->caste.size();
-    for (size_t j = 0; j < sizecas;j++)
-    {
-        df::caste_raw *caste = raw->caste[j];
-        if(caste->flags.is_set(caste_raw_flags::TRAINABLE_HUNTING))
-            return true;
-    }
-    return false;
+    return getRaceRawFlags(unit->race).trainable_hunting;
 }
 
 bool isTamable(df::unit* unit)
 {
-    df::creature_raw *raw = df::global::world->raws.creatures.all[unit->race];
-    size_t sizecas = raw->caste.size();
-    for (size_t j = 0; j < sizecas;j++)
-    {
-        df::caste_raw *caste = raw->caste[j];
-        if(caste->flags.is_set(caste_raw_flags::PET) ||
-            caste->flags.is_set(caste_raw_flags::PET_EXOTIC))
-            return true;
-    }
-    return false;
+    return getRaceRawFlags(unit->race).tamable;
 }
 
 bool isMale(df::unit* unit)
@@ -1091,8 +1106,114 @@ bool isContainedInItem(df::unit* unit)
     return contained;
 }
 
+// Lookup tables for the cage and nestbox queries below. Answering them by
+// scanning world->buildings.all makes autobutcher, autonestbox and the zone
+// filters O(units * buildings), so those passes build the index once through
+// a BuildingIndexScope and the queries use it while it is active.
+// Assignments made by the plugin during the pass keep it up to date.
+// Zone and chain membership is not indexed: it is read from the unit refs.
+struct BuildingIndex
+{
+    bool active;
+
+    // unit id -> built cage the unit is assigned to
+    std::unordered_map<int32_t, df::building*> unit_cage;
+    // units assigned to a built cage which is defined as a room
+    std::unordered_set<int32_t> unit_cage_room;
+    // map position -> first cage / nestbox at that position
+    std::unordered_map<uint64_t, df::building*> cage_at;
+    std::unordered_map<uint64_t, df::building*> nestbox_at;
+    // pens/pastures with a nestbox at their corner (candidates for autonestbox)
+    std::vector<df::building*> nestbox_zones;
+
+    BuildingIndex() : active(false) {}
+
+    static uint64_t key(int32_t x, int32_t y, int32_t z)
+    {
+        return (uint64_t(uint16_t(x)) << 32) | (uint64_t(uint16_t(y)) << 16) | uint64_t(uint16_t(z));
+    }
+
+    void addCagedUnit(int32_t unit_id, df::building *cage)
+    {
+        unit_cage.insert(std::make_pair(unit_id, cage));
+        if (cage->is_room)
+            unit_cage_room.insert(unit_id);
+    }
+
+    void build()
+    {
+        clear();
+
+        vector<df::building*> &buildings = world->buildings.all;
+        for (size_t b = 0; b < buildings.size(); b++)
+        {
+            df::building *building = buildings[b];
+            switch (building->getType())
+            {
+            case building_type::Cage:
+                {
+                    df::building_cagest* cage = (df::building_cagest*) building;
+                    for (size_t c = 0; c < cage->assigned_creature.size(); c++)
+                        addCagedUnit(cage->assigned_creature[c], building);
+                    cage_at.insert(std::make_pair(key(building->x1, building->y1, building->z), building));
+                    break;
+                }
+            case building_type::NestBox:
+                nestbox_at.insert(std::make_pair(key(building->x1, building->y1, building->z), building));
+                break;
+            default:
+                break;
+            }
+        }
+
+        // second pass: nestboxes may come after the zone in the vector
+        for (size_t b = 0; b < buildings.size(); b++)
+        {
+            df::building *building = buildings[b];
+            if (isPenPasture(building) &&
+                nestbox_at.count(key(building->x1, building->y1, building->z)))
+                nestbox_zones.push_back(building);
+        }
+
+        active = true;
+    }
+
+    void clear()
+    {
+        active = false;
+        unit_cage.clear();
+        unit_cage_room.clear();
+        cage_at.clear();
+        nestbox_at.clear();
+        nestbox_zones.clear();
+    }
+};
+
+static BuildingIndex building_index;
+
+// Builds the index for the duration of a pass. Nested scopes reuse the
+// index of the outermost one.
+class BuildingIndexScope
+{
+    bool owner;
+public:
+    BuildingIndexScope() : owner(!building_index.active)
+    {
+        if (owner)
+            building_index.build();
+    }
+    ~BuildingIndexScope()
+    {
+        if (owner)
+            building_index.clear();
+    }
+};
+
 bool isInBuiltCage(df::unit* unit)
 {
+    if (building_index.active)
+        return building_index.unit_cage.count(unit->id) != 0;
+
     bool caged = false;
     for (size_t b=0; b < world->buildings.all.size(); b++)
     {
@@ -1118,6 +1239,9 @@ bool isInBuiltCage(df::unit* unit)
 // built cage defined as room (supposed to detect zoo cages)
 bool isInBuiltCageRoom(df::unit* unit)
 {
+    if (building_index.active)
+        return building_index.unit_cage_room.count(unit->id) != 0;
+
     bool caged_room = false;
     for (size_t b=0; b < world->buildings.all.size(); b++)
     {
@@ -1147,31 +1271,15 @@ bool isInBuiltCageRoom(df::unit* unit)
     return caged_room;
 }
 
-// check a map position for a built cage
-// animals in cages are CONTAINED_IN_ITEM, no matter if they are on a stockpile or inside a built cage
-// if they are on animal stockpiles they should count as unassigned to allow pasturing them
-// if they are inside built cages they should be ignored in case the cage is a zoo or linked to a lever or whatever
-bool isBuiltCageAtPos(df::coord pos)
+// first cage at a map position, either from the index or by scanning all buildings
+static df::building * findCageAtPos(df::coord pos)
 {
-    bool cage = false;
-    for (size_t b=0; b < world->buildings.all.size(); b++)
+    if (building_index.active)
     {
-        df::building* building = world->buildings.all[b];
-        if( building->getType() == building_type::Cage
-            && building->x1 == pos.x
-            && building->y1 == pos.y
-            && building->z  == pos.z )
-        {
-            cage = true;
-            break;
-        }
+        auto it = building_index.cage_at.find(BuildingIndex::key(pos.x, pos.y, pos.z));
+        return it != building_index.cage_at.end() ? it->second : NULL;
     }
-    return cage;
-}
 
-df::building * getBuiltCageAtPos(df::coord pos)
-{
-    df::building* cage = NULL;
     for (size_t b=0; b < world->buildings.all.size(); b++)
     {
         df::building* building = world->buildings.all[b];
@@ -1179,21 +1287,20 @@ df::building * getBuiltCageAtPos(df::coord pos)
             && building->x1 == pos.x
             && building->y1 == pos.y
             && building->z  == pos.z )
-        {
-            // don't set pointer if not constructed yet
-            if(building->getBuildStage()!=building->getMaxBuildStage())
-                break;
-
-            cage = building;
-            break;
-        }
+            return building;
     }
-    return cage;
+    return NULL;
 }
 
-bool isNestboxAtPos(int32_t x, int32_t y, int32_t z)
+// first nestbox at a map position, either from the index or by scanning all buildings
+static df::building * findNestboxAtPos(int32_t x, int32_t y, int32_t z)
 {
-    bool found = false;
+    if (building_index.active)
+    {
+        auto it = building_index.nestbox_at.find(BuildingIndex::key(x, y, z));
+        return it != building_index.nestbox_at.end() ? it->second : NULL;
+    }
+
     for (size_t b=0; b < world->buildings.all.size(); b++)
     {
         df::building* building = world->buildings.all[b];
@@ -1201,34 +1308,40 @@ bool isNestboxAtPos(int32_t x, int32_t y, int32_t z)
             && building->x1 == x
             && building->y1 == y
             && building->z  == z )
-        {
-            found = true;
-            break;
-        }
+            return building;
     }
-    return found;
+    return NULL;
+}
+
+// check a map position for a built cage
+// animals in cages are CONTAINED_IN_ITEM, no matter if they are on a stockpile or inside a built cage
+// if they are on animal stockpiles they should count as unassigned to allow pasturing them
+// if they are inside built cages they should be ignored in case the cage is a zoo or linked to a lever or whatever
+bool isBuiltCageAtPos(df::coord pos)
+{
+    return findCageAtPos(pos) != NULL;
+}
+
+df::building * getBuiltCageAtPos(df::coord pos)
+{
+    df::building* cage = findCageAtPos(pos);
+
+    // don't set pointer if not constructed yet
+    if(cage && cage->getBuildStage()!=cage->getMaxBuildStage())
+        cage = NULL;
+
+    return cage;
+}
+
+bool isNestboxAtPos(int32_t x, int32_t y, int32_t z)
+{
+    return findNestboxAtPos(x, y, z) != NULL;
 }
 
 bool isFreeNestboxAtPos(int32_t x, int32_t y, int32_t z)
 {
-    bool found = false;
-    for (size_t b=0; b < world->buildings.all.size(); b++)
-    {
-        df::building* building = world->buildings.all[b];
-        if( building->getType() == building_type::NestBox
-            && building->x1 == x
-            && building->y1 == y
-            && building->z  == z )
-        {
-            df::building_nest_boxst* nestbox = (df::building_nest_boxst*) building;
-            if(nestbox->claimed_by == -1 && nestbox->contained_items.size() == 1)
-            {
-                found = true;
-                break;
-            }
-        }
-    }
-    return found;
+    df::building_nest_boxst* nestbox = (df::building_nest_boxst*) findNestboxAtPos(x, y, z);
+    return nestbox && nestbox->claimed_by == -1 && nestbox->contained_items.size() == 1;
 }
 
 bool isEmptyPasture(df::building* building)
@@ -1244,11 +1357,16 @@ bool isEmptyPasture(df::building* building)
 
 df::building* findFreeNestboxZone()
 {
+    // with the index only zones with a nestbox need to be looked at;
+    // emptiness and the nestbox state are rechecked since they change
+    // as units get assigned during the pass
+    vector<df::building*> &candidates = building_index.active
+        ? building_index.nestbox_zones : world->buildings.all;
+
     df::building * free_building = NULL;
-    bool cage = false;
-    for (size_t b=0; b < world->buildings.all.size(); b++)
+    for (size_t b=0; b < candidates.size(); b++)
     {
-        df::building* building = world->buildings.all[b];
+        df::building* building = candidates[b];
         if( isEmptyPasture(building) &&
             isActive(building) &&
             isFreeNestboxAtPos(building->x1, building->y1, building->z))
@@ -1339,6 +1457,27 @@ bool unassignUnitFromBuilding(df::unit* unit)
                 // game does not erase the ref until creature gets removed from cage
                 //unit->general_refs.erase(unit->general_refs.begin() + idx);
 
+                if (building_index.active)
+                {
+                    auto it = building_index.unit_cage.find(unit->id);
+                    if (it != building_index.unit_cage.end())
+                    {
+                        df::building_cagest* oldcage = (df::building_cagest*) it->second;
+                        for(size_t oc=0; oc<oldcage->assigned_creature.size(); oc++)
+                        {
+                            if(oldcage->assigned_creature[oc] == unit->id)
+                            {
+                                oldcage->assigned_creature.erase(oldcage->assigned_creature.begin() + oc);
+                                break;
+                            }
+                        }
+                        building_index.unit_cage.erase(it);
+                        building_index.unit_cage_room.erase(unit->id);
+                    }
+                    success = true;
+                    break;
+                }
+
                 // walk through buildings, check cages for inhabitants, compare ids
                 for (size_t b=0; b < world->buildings.all.size(); b++)
                 {
@@ -1473,6 +1612,8 @@ command_result assignUnitToCage(color_ostream& out, df::unit* unit, df::building
 
     df::building_cagest* civz = (df::building_cagest*) building;
     civz->assigned_creature.push_back(unit->id);
+    if (building_index.active)
+        building_index.addCagedUnit(unit->id, building);
 
     out << "Unit " << unit->id
         << "(" << getRaceName(unit) << ")"
@@ -2391,6 +2532,8 @@ command_result df_zone (color_ostream &out, vector <string> & parameters)
 
     if(building_assign || cagezone_assign || unit_info || unit_slaughter || nick_set)
     {
+        BuildingIndexScope index_scope;
+
         df::building * building;
         if(building_assign || cagezone_assign || (nick_set && !all && !find_count))
         {
@@ -2676,6 +2819,8 @@ command_result autoNestbox( color_ostream &out, bool verbose = false )
         return CR_FAILURE;
     }
 
+    BuildingIndexScope index_scope;
+
     do
     {
         df::building * free_building = findFreeNestboxZone();
@@ -3145,6 +3290,10 @@ command_result df_autobutcher(color_ostream &out, vector <string> & parameters)
 
         out << " sleep: " << sleep_autobutcher << endl;
 
+        out.print("Last pass checked %d units of %d races in %.2f ms.\n",
+                  int(last_autobutcher_units), int(last_autobutcher_races),
+                  last_autobutcher_us / 1000.0);
+
         out << "Default setting for new races:"
             << " fk=" << default_fk
             << " mk=" << default_mk
@@ -3406,50 +3555,81 @@ command_result autoButcher( color_ostream &out, bool verbose = false )
             return CR_OK;
     }
 
+    uint64_t start_time = GetTimeUs64();
+
+    BuildingIndexScope index_scope;
+
+    // bucket units by race, so that races which are neither watched nor going to be
+    // auto-watched are skipped without looking at their units at all.
+    // dead units can't become butcher candidates again and are dropped right away.
+    static vector< vector<df::unit*> > race_units;
+    for(size_t r=0; r<race_units.size(); r++)
+        race_units[r].clear();
+    race_units.resize(world->raws.creatures.all.size());
+
     for(size_t i=0; i<world->units.all.size(); i++)
     {
         df::unit * unit = world->units.all[i];
-
-        // this check is now divided into two steps, squeezed autowatch into the middle
-        // first one ignores completely inappropriate units (dead, undead, not belonging to the fort, ...)
-        // then let autowatch add units to the watchlist which will probably start breeding (owned pets, war animals, ...)
-        // then process units counting those which can't be butchered (war animals, named pets, ...)
-        // so that they are treated as "own stock" as well and count towards the target quota
-        if(    isDead(unit)
-            || isUndead(unit)
-            || isMarkedForSlaughter(unit)
-            || isMerchant(unit) // ignore merchants' draught animals
-            || isForest(unit) // ignore merchants' caged animals
-            || !isOwnCiv(unit)
-            || !isTame(unit)
-            )
+        if(isDead(unit) || unit->race < 0 || size_t(unit->race) >= race_units.size())
             continue;
+        race_units[unit->race].push_back(unit);
+    }
 
-        // found a bugged unit which had invalid coordinates but was not in a cage.
-        // marking it for slaughter didn't seem to have negative effects, but you never know...
-        if(!isContainedInItem(unit) && !hasValidMapPos(unit))
+    size_t checked_units = 0;
+    size_t checked_races = 0;
+
+    for(size_t race=0; race<race_units.size(); race++)
+    {
+        vector<df::unit*> &units = race_units[race];
+        if(units.empty())
             continue;
 
         WatchedRace * w = NULL;
-        int watched_index = getWatchedIndex(unit->race);
+        int watched_index = getWatchedIndex(race);
         if(watched_index != -1)
-        {
             w = watched_races[watched_index];
-        }
-        else if(enable_autobutcher_autowatch)
-        {
-            w = new WatchedRace(true, unit->race, default_fk, default_mk, default_fa, default_ma);
-            w->UpdateConfig(out);
-            watched_races.push_back(w);
 
-            string announce;
-            announce = "New race added to autobutcher watchlist: " + getRaceNamePlural(w->raceId);
-            Gui::showAnnouncement(announce, 2, false);
-            autobutcher_sortWatchList(out);
-        }
+        if(w ? !w->isWatched : !enable_autobutcher_autowatch)
+            continue;
+
+        checked_races++;
+
+        for(size_t i=0; i<units.size(); i++)
+        {
+            df::unit * unit = units[i];
+            checked_units++;
+
+            // this check is now divided into two steps, squeezed autowatch into the middle
+            // first one ignores completely inappropriate units (undead, not belonging to the fort, ...)
+            // then let autowatch add units to the watchlist which will probably start breeding (owned pets, war animals, ...)
+            // then process units counting those which can't be butchered (war animals, named pets, ...)
+            // so that they are treated as "own stock" as well and count towards the target quota
+            if(    isUndead(unit)
+                || isMarkedForSlaughter(unit)
+                || isMerchant(unit) // ignore merchants' draught animals
+                || isForest(unit) // ignore merchants' caged animals
+                || !isOwnCiv(unit)
+                || !isTame(unit)
+                )
+                continue;
+
+            // found a bugged unit which had invalid coordinates but was not in a cage.
+            // marking it for slaughter didn't seem to have negative effects, but you never know...
+            if(!isContainedInItem(unit) && !hasValidMapPos(unit))
+                continue;
+
+            if(!w)
+            {
+                w = new WatchedRace(true, unit->race, default_fk, default_mk, default_fa, default_ma);
+                w->UpdateConfig(out);
+                watched_races.push_back(w);
+
+                string announce;
+                announce = "New race added to autobutcher watchlist: " + getRaceNamePlural(w->raceId);
+                Gui::showAnnouncement(announce, 2, false);
+                autobutcher_sortWatchList(out);
+            }
 
-        if(w && w->isWatched)
-        {
             // don't butcher protected units, but count them as stock as well
             // this way they count towards target quota, so if you order that you want 1 female adult cat
             // and have 2 cats, one of them being a pet, the other gets butchered
@@ -3482,6 +3662,10 @@ command_result autoButcher( color_ostream &out, bool verbose = false )
         }
     }
 
+    last_autobutcher_us = GetTimeUs64() - start_time;
+    last_autobutcher_units = checked_units;
+    last_autobutcher_races = checked_races;
+
     return CR_OK;
 }
 
@@ -3674,6 +3858,7 @@ WatchedRace * checkRaceStocksTotal(int race)
 WatchedRace * checkRaceStocksProtected(int race)
 {
     WatchedRace * w = new WatchedRace(true, race, default_fk, default_mk, default_fa, default_ma);
+    BuildingIndexScope index_scope;
 
     for(size_t i=0; i<world->units.all.size(); i++)
     {
@@ -3711,6 +3896,7 @@ WatchedRace * checkRaceStocksProtected(int race)
 WatchedRace * checkRaceStocksButcherable(int race)
 {
     WatchedRace * w = new WatchedRace(true, race, default_fk, default_mk, default_fa, default_ma);
+    BuildingIndexScope index_scope;
 
     for(size_t i=0; i<world->units.all.size(); i++)
     {
@@ -3777,6 +3963,8 @@ WatchedRace * checkRaceStocksButcherFlag(int race)
 
 void butcherRace(int race)
 {
+    BuildingIndexScope index_scope;
+
     for(size_t i=0; i<world->units.all.size(); i++)
     {
         df::unit * unit = world->units.all[i];
@@ -4002,6 +4190,9 @@ static int autobutcher_getWatchList(lua_State *L)
     color_ostream &out = *Lua::GetOutput(L);
     lua_newtable(L);
 
+    // one index for the stock counts of all races
+    BuildingIndexScope index_scope;
+
     for(size_t i=0; i<watched_races.size(); i++)
     {
         lua_newtable(L);
@@ -4162,6 +4353,7 @@ public:
         }
         
         string search_string_l = toLower(search_string);
+        BuildingIndexScope index_scope;
         saved_indexes.clear();
         ui_building_assign_type->clear();
         ui_building_assign_is_marked->clear();
@@ -0,0 +1,39 @@
+-- Measures the rate of DF field reads from lua, with and without the fast path.
+
+local args = {...}
+local count = tonumber(args[1] or 1000000)
+
+local unit = df.global.world.units.all[0]
+if not unit then
+    qerror('This benchmark needs at least one unit.')
+end
+
+local pos = unit.pos
+local flags = unit.flags1
+
+local tests = {
+    { 'unit.id (int32)', function(n) local v for i = 1,n do v = unit.id end end },
+    { 'unit.sex (int8)', function(n) local v for i = 1,n do v = unit.sex end end },
+    { 'unit.profession (enum)', function(n) local v for i = 1,n do v = unit.profession end end },
+    { 'pos.x (int16)', function(n) local v for i = 1,n do v = pos.x end end },
+    { 'flags1.dead (bitfield)', function(n) local v for i = 1,n do v = flags.dead end end },
+    { 'unit.name (substruct)', function(n) local v for i = 1,n/10 do v = unit.name end end, 10 },
+}
+
+local function measure(fn, scale)
+    local start = os.clock()
+    fn(count)
+    local elapsed = math.max(os.clock() - start, 1e-6)
+    return count / (scale or 1) / elapsed
+end
+
+print(('Field reads per second (%d iterations):'):format(count))
+print(('  %-30s %14s %14s'):format('field', 'generic', 'fast path'))
+
+for _,test in ipairs(tests) do
+    dfhack.internal.setFastFieldReads(false)
+    local slow = measure(test[2], test[3])
+    dfhack.internal.setFastFieldReads(true)
+    local fast = measure(test[2], test[3])
+    print(('  %-30s %14.0f %14.0f'):format(test[1], slow, fast))
+end
@@ -0,0 +1,49 @@
+-- Measures the latency of dfhack.run_script with and without the chunk cache.
+
+local args = {...}
+local count = tonumber(args[1] or 200)
+local lines = tonumber(args[2] or 500)
+
+local name = 'devel/_bench_run_script_sample'
+local file = dfhack.getHackPath()..'scripts/'..name..'.lua'
+
+-- Generate a script of the requested size that does almost nothing when run
+local f = io.open(file, 'w') or qerror('Could not create '..file)
+f:write('local args = {...}\n')
+for i = 1,lines-2,3 do
+    f:write(('local function fn%d(a, b)\n'):format(i))
+    f:write(('    return a * %d + (b or 0) - #tostring(a)\n'):format(i))
+    f:write('end\n')
+end
+f:write('return args[1]\n')
+f:close()
+
+local function measure(cache)
+    local internal = dfhack.internal
+    local saved = internal.script_cache
+    internal.script_cache = cache
+
+    dfhack.run_script(name, 1)
+    local start = os.clock()
+    for i = 1,count do
+        dfhack.run_script(name, i)
+    end
+    local elapsed = os.clock() - start
+
+    internal.script_cache = saved
+    return elapsed * 1000000 / count
+end
+
+local ok, err = pcall(function()
+    local uncached = measure(false)
+    local cached = measure(true)
+    print(('%d runs of a %d-line script:'):format(count, lines))
+    print(('  without cache: %8.1f us per run'):format(uncached))
+    print(('  with cache:    %8.1f us per run'):format(cached))
+end)
+
+os.remove(file)
+
+if not ok then
+    qerror(err)
+end
@@ -0,0 +1,22 @@
+-- Compares workflow constraint matching with a linear scan and with the dispatch table.
+
+local workflow = require 'plugins.workflow'
+
+local args = {...}
+local count = tonumber(args[1] or 100000)
+
+local r = workflow.benchmarkMatching(count)
+
+print(('Matched %d synthetic items against %d constraints:'):format(r.items, r.constraints))
+print(('  %-16s %10s %10s %12s'):format('method', 'total ms', 'ns/item', 'matches'))
+
+local function row(name, us, matches)
+    print(('  %-16s %10.1f %10.0f %12d'):format(name, us/1000, us*1000/r.items, matches))
+end
+
+row('linear scan', r.linear_us, r.linear_matches)
+row('dispatch table', r.dispatch_us, r.dispatch_matches)
+
+if r.linear_matches ~= r.dispatch_matches then
+    dfhack.printerr('Warning: the match counts differ.')
+end
@@ -0,0 +1,33 @@
+-- Show or tune the garbage collector of the core lua context.
+
+local args = {...}
+local cmd = args[1] or 'stats'
+
+if cmd == 'step' then
+    local kb = tonumber(args[2])
+    if not kb or kb < 0 then
+        qerror('Invalid step size: '..tostring(args[2]))
+    end
+    dfhack.internal.setGCStep(kb)
+elseif cmd == 'reset' then
+    dfhack.internal.resetGCStats()
+    return
+elseif cmd == 'collect' then
+    collectgarbage('collect')
+elseif cmd ~= 'stats' then
+    qerror('Usage: lua-gc [stats|step <kb>|collect|reset]')
+end
+
+local st = dfhack.internal.getGCStats()
+
+if st.step_kb > 0 then
+    print(('Frame step: %d KB'):format(st.step_kb))
+else
+    print('Frame step: disabled, automatic collection only')
+end
+print(('Heap size: %d KB'):format(st.heap_kb))
+print(('Frame steps: %d, completed cycles: %d'):format(st.steps, st.cycles))
+print(('Step time: last %d us, avg %.1f us, max %d us'):format(
+    st.last_step_us, st.avg_step_us, st.max_step_us))
+print(('Full collections: %d, last took %d us'):format(
+    st.full_collections, st.last_full_us))
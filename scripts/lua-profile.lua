@@ -0,0 +1,71 @@
+-- Sampling profiler for lua code running in the core context.
+
+local args = {...}
+local cmd = args[1]
+
+local function sorted_entries(tbl, limit)
+    local list = {}
+    for k,v in pairs(tbl) do
+        table.insert(list, { name = k, count = v })
+    end
+    table.sort(list, function(a,b) return a.count > b.count end)
+    if limit and #list > limit then
+        for i = #list,limit+1,-1 do list[i] = nil end
+    end
+    return list
+end
+
+local function print_top(title, tbl, total, limit)
+    print(title)
+    for _,e in ipairs(sorted_entries(tbl, limit)) do
+        print(('  %6d %5.1f%%  %s'):format(e.count, 100*e.count/total, e.name))
+    end
+end
+
+if cmd == 'start' then
+    local count = tonumber(args[2] or 10000)
+    if not count or count < 1 then
+        qerror('Invalid sampling interval: '..tostring(args[2]))
+    end
+    dfhack.internal.profileStart(count)
+    print('Lua profiler started, sampling every '..count..' instructions.')
+elseif cmd == 'stop' then
+    dfhack.internal.profileStop()
+    print('Lua profiler stopped.')
+elseif cmd == 'report' then
+    local data = dfhack.internal.getProfile()
+    local limit = tonumber(args[2] or 20)
+    if data.samples == 0 then
+        print('No samples collected.')
+        return
+    end
+
+    local owners = {}
+    for stack,count in pairs(data.stacks) do
+        local owner = string.match(stack, '^[^;]*')
+        owners[owner] = (owners[owner] or 0) + count
+    end
+
+    print(('%d samples, every %d instructions%s.'):format(
+        data.samples, data.count, data.active and ' (still running)' or ''))
+    print_top('By owner:', owners, data.samples)
+    print_top('By function:', data.functions, data.samples, limit)
+    print_top('By line:', data.lines, data.samples, limit)
+elseif cmd == 'dump' then
+    local fname = args[2] or qerror('Usage: lua-profile dump <file>')
+    local data = dfhack.internal.getProfile()
+    local f = io.open(fname, 'w') or qerror('Could not open '..fname)
+    for _,e in ipairs(sorted_entries(data.stacks)) do
+        f:write(e.name, ' ', e.count, '\n')
+    end
+    f:close()
+    print(('Wrote %d samples to %s.'):format(data.samples, fname))
+else
+    print([[
+Usage:
+  lua-profile start [count]   - start sampling every 'count' lua instructions
+  lua-profile stop            - stop sampling
+  lua-profile report [limit]  - print samples by owner, function and line
+  lua-profile dump <file>     - write collapsed stacks for flamegraph.pl
+]])
+end